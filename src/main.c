@@ -1,13 +1,28 @@
 #include "cglm/types.h"
+#include "mesh.h"
+#include "meshopt.h"
 #include <vulkan/vulkan_core.h>
 #define GLFW_INCLUDE_VULKAN
 #include <GLFW/glfw3.h>
 #include <assert.h>
 #include <cglm/cglm.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #ifdef NDEBUG
 const bool enableValidationLayers = false;
@@ -24,6 +39,7 @@ const bool enableValidationLayers = true;
 typedef struct {
     optional_type(uint32_t) graphicsFamily;
     optional_type(uint32_t) presentFamily;
+    optional_type(uint32_t) transferFamily; // graphics family if no DMA queue
 } QueueFamilyIndices;
 
 bool isComplete(QueueFamilyIndices indices) {
@@ -43,44 +59,598 @@ struct Vertex {
     vec2 pos;
     vec3 color;
 };
+// mesh files are uploaded without conversion
+_Static_assert(sizeof(struct Vertex) == sizeof(MeshVertex),
+               "struct Vertex must match MeshVertex");
+
+// Compact layout for --packed-vertices, 8 bytes instead of 20. Positions are
+// snorm so they have to lie in [-1, 1], which holds for the quad and for
+// meshes converted with meshconv -n.
+struct PackedVertex {
+    int16_t pos[2];   // R16G16_SNORM
+    uint8_t color[4]; // R8G8B8A8_UNORM, alpha is unused
+};
 
-static VkVertexInputBindingDescription getBindingDescription() {
+static VkVertexInputBindingDescription getBindingDescription(bool packed) {
     VkVertexInputBindingDescription bindingDescription = {
         .binding = 0,
-        .stride = sizeof(struct Vertex),
+        .stride = packed ? sizeof(struct PackedVertex) : sizeof(struct Vertex),
         .inputRate = VK_VERTEX_INPUT_RATE_VERTEX,
     };
     return bindingDescription;
 }
 
-static VkVertexInputAttributeDescription getPositionAttributeDescription() {
+static VkVertexInputAttributeDescription
+getPositionAttributeDescription(bool packed) {
     VkVertexInputAttributeDescription positionAttributeDescription = {
         .binding = 0,
         .location = 0,
         .format = VK_FORMAT_R32G32_SFLOAT,
         .offset = offsetof(struct Vertex, pos),
     };
+    if (packed) {
+        positionAttributeDescription.format = VK_FORMAT_R16G16_SNORM;
+        positionAttributeDescription.offset =
+            offsetof(struct PackedVertex, pos);
+    }
     return positionAttributeDescription;
 }
 
-static VkVertexInputAttributeDescription getColorAttributeDescription() {
+static VkVertexInputAttributeDescription
+getColorAttributeDescription(bool packed) {
     VkVertexInputAttributeDescription colorAttributeDescription = {
         .binding = 0,
         .location = 1,
         .format = VK_FORMAT_R32G32B32_SFLOAT,
         .offset = offsetof(struct Vertex, color),
     };
+    // the shader's vec3 input ignores the fourth component
+    if (packed) {
+        colorAttributeDescription.format = VK_FORMAT_R8G8B8A8_UNORM;
+        colorAttributeDescription.offset = offsetof(struct PackedVertex, color);
+    }
     return colorAttributeDescription;
 }
 
+// Per instance data, the quad is scaled, moved and tinted in the vertex
+// shader so every instance shares one vertex and index buffer.
+struct Instance {
+    vec2 offset;
+    vec2 scale;
+    vec3 color;
+};
+
+static VkVertexInputBindingDescription getInstanceBindingDescription() {
+    VkVertexInputBindingDescription bindingDescription = {
+        .binding = 1,
+        .stride = sizeof(struct Instance),
+        .inputRate = VK_VERTEX_INPUT_RATE_INSTANCE,
+    };
+    return bindingDescription;
+}
+
+static VkVertexInputAttributeDescription getOffsetAttributeDescription() {
+    VkVertexInputAttributeDescription offsetAttributeDescription = {
+        .binding = 1,
+        .location = 2,
+        .format = VK_FORMAT_R32G32_SFLOAT,
+        .offset = offsetof(struct Instance, offset),
+    };
+    return offsetAttributeDescription;
+}
+
+static VkVertexInputAttributeDescription getScaleAttributeDescription() {
+    VkVertexInputAttributeDescription scaleAttributeDescription = {
+        .binding = 1,
+        .location = 3,
+        .format = VK_FORMAT_R32G32_SFLOAT,
+        .offset = offsetof(struct Instance, scale),
+    };
+    return scaleAttributeDescription;
+}
+
+static VkVertexInputAttributeDescription getTintAttributeDescription() {
+    VkVertexInputAttributeDescription tintAttributeDescription = {
+        .binding = 1,
+        .location = 4,
+        .format = VK_FORMAT_R32G32B32_SFLOAT,
+        .offset = offsetof(struct Instance, color),
+    };
+    return tintAttributeDescription;
+}
+
+// Device memory is carved out of large blocks with a buddy allocator instead
+// of one vkAllocateMemory per resource. Blocks shrink on small heaps so a
+// single block never takes more than an eighth of its heap.
+#define ALLOCATOR_BLOCK_SIZE (64ull * 1024 * 1024)
+#define ALLOCATOR_MIN_BLOCK_SIZE (1ull * 1024 * 1024)
+#define ALLOCATOR_MIN_ALLOCATION 256ull
+#define ALLOCATOR_MAX_BLOCKS 256
+
+// Uploads are staged through a persistently mapped ring buffer and recorded
+// into batches, each batch completes at a graphics timeline value.
+#define UPLOAD_RING_SIZE (16ull * 1024 * 1024)
+#define UPLOAD_CHUNK_SIZE (UPLOAD_RING_SIZE / 4)
+#define UPLOAD_RING_ALIGNMENT 16ull
+#define UPLOAD_BATCH_COUNT 4
+#define UPLOAD_MAX_COPIES 1024
+// where uploaded data may be consumed on the graphics queue
+#define UPLOAD_DST_STAGES                                                      \
+    (VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_INPUT_BIT | \
+     VK_PIPELINE_STAGE_VERTEX_SHADER_BIT |                                     \
+     VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT |                                   \
+     VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT)
+#define UPLOAD_DST_ACCESS                                                      \
+    (VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT |          \
+     VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_UNIFORM_READ_BIT |        \
+     VK_ACCESS_SHADER_READ_BIT)
+
+// driver compiled pipelines persist across runs in this file
+#define PIPELINE_CACHE_PATH "pipeline_cache.bin"
+
+// --hot-reload recompiles the graphics shaders from here, relative to the
+// repository root
+#define SHADER_DIR "src/shaders"
+#define GLSLC "glslc"
+// editors save in bursts, a change is compiled once it has been quiet this
+// long
+#define SHADER_RELOAD_SETTLE_MS 100
+#define MAX_PIPELINE_VARIANTS 32
+#define PIPELINE_SPEC_CONSTANTS 1 // constant_id 0 up to this, all int
+
 #define SWAPCHAIN_LENGTH 64
-#define MAX_FRAMES_IN_FLIGHT 2
+// resize events closer together than this are handled as one recreation
+#define RESIZE_DEBOUNCE_NS (50ull * 1000 * 1000)
+// capacity of the per-frame arrays, the pacing mode picks how many of the
+// slots are used at startup
+#define MAX_FRAMES_IN_FLIGHT 4
+#define MAX_RECORD_THREADS 32
+#define MAX_MESHES 16
+// shaders/cull.comp writes the visible draw count here and the compacted
+// draw commands after it
+#define VISIBLE_COUNT_OFFSET 0
+#define VISIBLE_DRAWS_OFFSET 16
+#define CULL_WORKGROUP_SIZE 64
+#define UNIFORM_RING_SLICE_SIZE (64 * 1024) // per frame in flight
+#define HEADLESS_DEFAULT_FRAMES 1000
+#define BENCH_DEFAULT_WARMUP 100
+
+// SPIR-V compiled from src/shaders by the Makefile, glslc -mfmt=num writes
+// the words as a comma separated list
+static const uint32_t vertShaderCode[] = {
+#include "shader.vert.inc"
+};
+static const uint32_t fragShaderCode[] = {
+#include "shader.frag.inc"
+};
+static const uint32_t cullShaderCode[] = {
+#include "cull.comp.inc"
+};
 
 GLFWwindow* window;
 const uint32_t WIDTH = 800;
 const uint32_t HEIGHT = 800;
 // const int MAX_FRAMES_IN_FLIGHT = 2;
 
+// command line options
+bool headless = false;   // render offscreen without GLFW or a swapchain
+uint64_t frameLimit = 0; // 0 renders until the window is closed
+bool bench = false;      // time frames and print a report on exit
+uint64_t benchWarmup = BENCH_DEFAULT_WARMUP;
+enum { BENCH_FORMAT_JSON, BENCH_FORMAT_CSV } benchFormat = BENCH_FORMAT_JSON;
+uint32_t instanceCount = 1; // quads drawn, split evenly across drawCount
+uint32_t drawCount = 1;     // instanced draws in the draw list
+uint32_t recordThreads = 0; // 0 records every draw on the main thread
+bool staticCommands = false; // reuse one recorded command buffer per image
+// --mesh files, the built-in quad when there are none
+const char* meshPaths[MAX_MESHES];
+uint32_t meshPathCount = 0;
+bool packedVertices = false;  // quantize vertices to struct PackedVertex
+bool optimizeMeshOnLoad = false; // run src/meshopt.c on the --mesh files
+bool indirectDraws = false; // draw commands come from a device buffer
+bool cullDraws = false;      // a compute pass drops draws outside the view
+bool hotReload = false;      // rebuild the pipeline when a shader changes
+bool serialInit = false;     // run every startup stage on the main thread
+bool animate = false;        // rotate the scene and pulse its tint
+uint64_t startupRuns = 0; // > 0 only initializes and tears down, this often
+uint32_t sceneSpread = 1;    // instances cover sceneSpread^2 viewports
+
+// What the fragment shader draws, a specialization constant of its
+// pipeline variant. Windowed runs cycle through them with the V key.
+typedef enum {
+    VIEW_SHADED,
+    VIEW_WIREFRAME, // needs fillModeNonSolid
+    VIEW_OVERDRAW,  // additive, brighter where triangles stack up
+    VIEW_MODE_COUNT,
+} ViewMode;
+const char* const viewModeNames[] = {"shaded", "wireframe", "overdraw"};
+ViewMode viewMode = VIEW_SHADED;
+
+// Pacing trades latency for throughput: how many frames the CPU may queue
+// ahead of the GPU, which present modes are preferred and whether input is
+// sampled before or after waiting for a free frame slot.
+typedef enum {
+    PACING_LOW_LATENCY,
+    PACING_BALANCED,
+    PACING_THROUGHPUT,
+} PacingMode;
+const char* const pacingNames[] = {"low-latency", "balanced", "throughput"};
+PacingMode pacing = PACING_BALANCED;
+uint32_t framesInFlight; // derived from the pacing mode by parseArgs
+
+typedef struct {
+    double min, mean, p50, p95, p99, max, total;
+} Summary;
+
+// Startup stages timed by markStartupStage(). The tasks run next to the
+// main thread stages, so the stages add up to more than the startup time.
+typedef enum {
+    STARTUP_WINDOW,
+    STARTUP_INSTANCE,
+    STARTUP_SURFACE,
+    STARTUP_PHYSICAL_DEVICE,
+    STARTUP_LOGICAL_DEVICE,
+    STARTUP_ALLOCATOR,
+    STARTUP_SWAPCHAIN,
+    STARTUP_RENDER_PASS,
+    STARTUP_PIPELINE_CACHE,
+    STARTUP_FRAMEBUFFERS,
+    STARTUP_COMMAND_POOL,
+    STARTUP_UNIFORM_RING,
+    STARTUP_MESH_BUFFERS,
+    STARTUP_DRAW_DATA,
+    STARTUP_UPLOAD_FLUSH,
+    STARTUP_COMMAND_BUFFERS,
+    STARTUP_SYNC_OBJECTS,
+    STARTUP_PIPELINE_WAIT,
+    STARTUP_FRAME_DESCRIPTORS,
+    STARTUP_CULL_DESCRIPTORS,
+    STARTUP_STATIC_COMMANDS,
+    STARTUP_SHADER_RELOADER,
+    STARTUP_MESH_FILES_TASK,
+    STARTUP_PIPELINES_TASK,
+    STARTUP_STAGE_COUNT,
+} StartupStage;
+const char* const startupStageNames[] = {
+    "window",            "instance",         "surface",
+    "physical_device",   "logical_device",   "allocator",
+    "swapchain",         "render_pass",      "pipeline_cache",
+    "framebuffers",      "command_pool",     "uniform_ring",
+    "mesh_buffers",      "draw_data",        "upload_flush",
+    "command_buffers",   "sync_objects",     "pipeline_wait",
+    "frame_descriptors", "cull_descriptors", "static_commands",
+    "shader_reloader",   "mesh_files_task",  "pipelines_task",
+};
+
+// CPU time in milliseconds spent blocked inside the current frame, plus the
+// GPU time of the last frame that used the same frame-in-flight slot
+typedef struct {
+    double fenceWaitMs;
+    double acquireMs;
+    double presentMs;
+    double inputLatencyMs; // input sample to present, or submit if headless
+    bool gpuValid;
+    double gpuFrameMs;
+    double gpuDrawMs;
+} FrameTimings;
+
+// one sample per measured frame, allocated for the benchmark run only
+typedef struct {
+    uint64_t frameCount;
+    double* frameMs;
+    double* fenceWaitMs;
+    double* acquireMs;
+    double* presentMs;
+    double* inputLatencyMs;
+    uint64_t gpuFrameCount; // frames that had timestamp results
+    double* gpuFrameMs;
+    double* gpuDrawMs;
+} BenchSamples;
+
+// Linear (buffers) and optimal (images) resources live in separate blocks,
+// which satisfies bufferImageGranularity without padding every allocation.
+typedef enum {
+    ALLOCATION_LINEAR,
+    ALLOCATION_OPTIMAL,
+} AllocationKind;
+
+typedef struct {
+    VkDeviceMemory memory; // VK_NULL_HANDLE when the slot is unused
+    VkDeviceSize size;
+    uint32_t memoryTypeIndex;
+    AllocationKind kind;
+    bool dedicated; // holds exactly one allocation too large for a block
+    void* mapped;   // whole block, mapped once if host visible
+    // Buddy tree over leaves of ALLOCATOR_MIN_ALLOCATION bytes stored as an
+    // implicit binary heap. Each node holds 1 + the order of the largest
+    // free run in its subtree, or 0 when nothing in it is free.
+    uint8_t* tree;
+    uint32_t maxOrder; // order of the root, leaves are order 0
+    VkDeviceSize usedBytes;
+    VkDeviceSize requestedBytes;
+    uint32_t allocationCount;
+} MemoryBlock;
+
+typedef struct {
+    VkDeviceMemory memory;
+    VkDeviceSize offset;
+    VkDeviceSize size;    // size requested by the resource
+    void* mapped;         // NULL unless the memory is host visible
+    uint32_t blockIndex;
+    uint32_t node;        // buddy tree node, unused for dedicated blocks
+} MemoryAllocation;
+
+typedef struct {
+    uint32_t blockCount;
+    uint32_t allocationCount;
+    VkDeviceSize allocatedBytes; // device memory owned by the allocator
+    VkDeviceSize usedBytes;      // handed out, after rounding to buddies
+    VkDeviceSize requestedBytes; // asked for by resources
+    VkDeviceSize largestFreeBytes;
+    // 1 - largest free run / total free bytes, 0 means free memory is
+    // contiguous
+    double fragmentation;
+} AllocatorStats;
+
+// Identifies the batch an upload was recorded into. Tickets increase
+// monotonically and complete in order, 0 is never issued.
+typedef uint64_t UploadTicket;
+
+typedef struct {
+    VkBuffer dstBuffer;
+    VkBufferCopy region;
+} UploadCopy;
+
+// With a dedicated transfer queue each batch is two submits: the copies and
+// a release barrier on the transfer queue, then the matching acquire barrier
+// on the graphics queue once the transfer timeline reaches the copies. The
+// last submit of a batch is always on the graphics queue.
+typedef struct {
+    VkCommandBuffer commandBuffer;        // transfer queue
+    VkCommandBuffer acquireCommandBuffer; // graphics queue, dedicated only
+    uint64_t graphicsValue; // graphics timeline value once the batch is done
+    UploadTicket ticket;
+    VkDeviceSize ringEnd; // ring head after this batch's staging data
+} UploadBatch;
+
+typedef struct {
+    VkBuffer stagingBuffer;
+    MemoryAllocation stagingMemory;
+    // absolute byte counters, the ring position is head % UPLOAD_RING_SIZE
+    VkDeviceSize head; // next free byte
+    VkDeviceSize tail; // oldest byte the GPU may still read
+    VkCommandPool commandPool;        // transfer queue family
+    VkCommandPool acquireCommandPool; // graphics queue family
+    bool dedicatedQueue; // uploads need queue family ownership transfers
+    UploadBatch batches[UPLOAD_BATCH_COUNT]; // indexed by ticket % count
+    UploadCopy copies[UPLOAD_MAX_COPIES];    // pending in the open batch
+    uint32_t copyCount;
+    UploadTicket openTicket;      // ticket of the batch being recorded
+    UploadTicket completedTicket; // every ticket up to this one is done
+} UploadManager;
+
+// Every submit to a queue signals the next value of the queue's timeline
+// semaphore, so waiting for a value waits for exactly that submit and all
+// earlier work on the queue.
+typedef struct {
+    VkSemaphore semaphore;
+    uint64_t lastSubmitted; // value the most recent submit signals
+} Timeline;
+
+// Objects that submitted work may still use are queued for destruction
+// with the graphics timeline value of the last submit that could use them,
+// and destroyed once the timeline passes it.
+typedef enum {
+    DELETION_BUFFER, // together with its memory
+    DELETION_MEMORY,
+    DELETION_IMAGE_VIEW,
+    DELETION_FRAMEBUFFER,
+    DELETION_PIPELINE,
+    DELETION_SWAPCHAIN,
+} DeletionKind;
+
+typedef struct {
+    DeletionKind kind;
+    uint64_t value;
+    union {
+        VkBuffer buffer;
+        VkImageView imageView;
+        VkFramebuffer frameBuffer;
+        VkPipeline pipeline;
+        VkSwapchainKHR swapChain;
+    };
+    MemoryAllocation memory; // DELETION_BUFFER and DELETION_MEMORY
+} Deletion;
+
+// entries are pushed in timeline order, [head, count) are still pending
+typedef struct {
+    Deletion* entries;
+    size_t head;
+    size_t count;
+    size_t capacity;
+} DeletionQueue;
+
+// A replaced swapchain and how many presents it still has to wait out.
+typedef struct {
+    VkSwapchainKHR swapChain;
+    uint32_t presentsLeft;
+} RetiredSwapChain;
+
+// Everything a graphics pipeline is built from. Filled by describePipeline()
+// and compared bytewise.
+typedef struct {
+    uint64_t vertHash; // of the SPIR-V
+    uint64_t fragHash;
+    int32_t specialization[PIPELINE_SPEC_CONSTANTS]; // by constant_id
+    uint32_t packedVertices;
+    VkPrimitiveTopology topology;
+    VkPolygonMode polygonMode;
+    VkCullModeFlags cullMode;
+    uint32_t additiveBlend;
+    VkPipelineLayout layout;
+    VkRenderPass renderPass;
+} PipelineKey;
+
+typedef enum {
+    VARIANT_QUEUED, // waiting for the registry thread
+    VARIANT_BUILDING,
+    VARIANT_READY,
+    VARIANT_FAILED,
+} VariantState;
+
+typedef struct {
+    PipelineKey key;
+    uint64_t hash;
+    VariantState state;
+    VkPipeline pipeline;
+} PipelineVariant;
+
+// Graphics pipelines by PipelineKey. A missing variant is built by the
+// first thread asking for it, or ahead of time by the registry thread once
+// prefetchPipeline() queued it. Variants live until the shaders change.
+typedef struct {
+    pthread_t thread;
+    bool threadStarted;
+    pthread_mutex_t mutex;
+    pthread_cond_t queued; // a variant was queued or quit was set
+    pthread_cond_t built;  // a variant left VARIANT_BUILDING
+    bool quit;
+    // the shaders every variant is built from, heap copies once reloaded
+    const uint32_t* vertCode;
+    size_t vertSize;
+    const uint32_t* fragCode;
+    size_t fragSize;
+    bool ownsCode;
+    PipelineKey current; // of graphicsPipeline
+    uint32_t builds;     // variants compiled so far, for the bench report
+    uint32_t variantCount;
+    PipelineVariant variants[MAX_PIPELINE_VARIANTS];
+} PipelineRegistry;
+
+// Shaders and the pipeline built from them, waiting for the main thread.
+typedef struct {
+    VkPipeline pipeline;
+    PipelineKey key;
+    uint32_t* vertCode;
+    size_t vertSize;
+    uint32_t* fragCode;
+    size_t fragSize;
+} ReloadedShaders;
+
+// A watcher thread recompiles the graphics shaders when a file in SHADER_DIR
+// is written and builds the replacement pipeline, the main thread swaps it
+// in between frames.
+typedef struct {
+    pthread_t thread;
+    int inotifyFd;
+    int stopPipe[2]; // written to wake the thread up for shutdown
+    pthread_mutex_t mutex;
+    ReloadedShaders pending; // built but not swapped in yet
+} ShaderReloader;
+
+// A startup stage running on its own thread while initVulkan() continues
+// with stages that don't depend on it.
+typedef struct {
+    pthread_t thread;
+    int (*run)();
+    StartupStage stage; // where its run time is reported
+    int result;
+    bool started; // false once joined, or if run() ran inline
+} InitTask;
+
+// where one mesh lives in the shared vertex and index buffers
+typedef struct {
+    uint32_t firstIndex;
+    uint32_t indexCount;
+    int32_t vertexOffset;
+    float bounds[4]; // min xy, max xy of the positions, only for culling
+} MeshRange;
+
+// push constants of shaders/cull.comp
+typedef struct {
+    mat4 mvp; // FrameData.mvp
+    float view[4]; // min xy, max xy in clip space
+    uint32_t drawCount;
+} CullConstants;
+
+// std140 block at set 0, binding 0 of shaders/shader.vert
+typedef struct {
+    float tint[4]; // multiplied into every vertex color
+    float time;    // seconds since startup
+    float padding[3];
+} FrameUniforms;
+
+// What the draws of the frame being recorded read, set by updateFrameData()
+// before any recording starts.
+typedef struct {
+    mat4 mvp;               // push constant of shaders/shader.vert
+    uint32_t uniformOffset; // of its FrameUniforms in the uniform ring
+} FrameData;
+
+// A host coherent buffer that stays mapped for the whole run, cut into one
+// slice per frame in flight and a last one that --static-cmds fills once.
+// A frame only writes its own slice, after waiting for the slot, so no
+// data is rewritten while the GPU reads it and nothing is mapped per frame.
+typedef struct {
+    VkBuffer buffer;
+    MemoryAllocation memory;
+    VkDeviceSize alignment; // minUniformBufferOffsetAlignment
+    uint32_t slice;         // being written
+    VkDeviceSize head;      // next free byte of the slice
+} UniformRing;
+
+// Vertex and index data of one mesh waiting for upload, pointing into a
+// mapped file, into heap copies or at the built-in quad.
+typedef struct {
+    const MeshVertex* vertices;
+    const void* indices;
+    uint32_t indexSize;
+    uint64_t vertexCount;
+    uint64_t indexCount;
+    void* mapping; // released by closeMeshSource()
+    size_t mappingSize;
+    MeshVertex* ownedVertices;
+    uint32_t* ownedIndices;
+} MeshSource;
+
+// timestamps written by recordCommandBuffer into each frame's query pool
+enum {
+    TIMESTAMP_FRAME_BEGIN,
+    TIMESTAMP_DRAW_BEGIN,
+    TIMESTAMP_DRAW_END,
+    TIMESTAMP_FRAME_END,
+    TIMESTAMP_COUNT,
+};
+
+// Each worker records one slice of the draw list into a secondary command
+// buffer from its own pool, pools are per frame in flight so a worker can
+// reset its pool as soon as that frame's timeline value is reached.
+typedef struct {
+    pthread_t thread;
+    uint32_t index;
+    VkCommandPool commandPools[MAX_FRAMES_IN_FLIGHT];
+    VkCommandBuffer commandBuffers[MAX_FRAMES_IN_FLIGHT];
+    int result;
+} RecordWorker;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t start; // generation changed or quit was set
+    pthread_cond_t done;  // pending dropped to zero
+    uint64_t generation;  // bumped once per frame recorded in parallel
+    uint32_t pending;     // workers still recording this generation
+    bool quit;
+    // the frame being recorded, written only while no worker is busy
+    uint32_t frame;
+    uint32_t imageIndex;
+    VkQueryPool timestampPool;
+    uint32_t workerCount;
+    RecordWorker workers[MAX_RECORD_THREADS];
+} RecordPool;
+
+FrameTimings frameTimings;
+BenchSamples benchSamples;
+
 const char* const validationLayers[] = {"VK_LAYER_KHRONOS_validation"};
 
 const char* const deviceExtensions[] = {VK_KHR_SWAPCHAIN_EXTENSION_NAME};
@@ -97,33 +667,115 @@ VkPhysicalDevice physicalDevice = VK_NULL_HANDLE;
 VkDevice device;
 VkQueue graphicsQueue;
 VkQueue presentQueue;
+VkQueue transferQueue; // may be graphicsQueue when there is no DMA queue
+uint32_t graphicsQueueFamily;
+uint32_t transferQueueFamily;
 VkSwapchainKHR swapChain;
 uint32_t swapChainImageCount;
 VkImage swapChainImages[SWAPCHAIN_LENGTH]; // excess arbitrary length
 VkImageView swapChainImageViews[SWAPCHAIN_LENGTH];
 VkFramebuffer swapChainFrameBuffers[SWAPCHAIN_LENGTH];
+MemoryAllocation offscreenImageMemory[SWAPCHAIN_LENGTH]; // headless only
 VkFormat swapChainImageFormat;
 VkExtent2D swapChainExtent;
 VkRenderPass renderPass;
+VkPipelineCache pipelineCache;
 VkPipelineLayout pipelineLayout;
 VkPipeline graphicsPipeline;
 VkCommandPool commandPool;
 VkBuffer vertexBuffer;
-VkDeviceMemory vertexBufferMemory;
+MemoryAllocation vertexBufferMemory;
 VkBuffer indexBuffer;
-VkDeviceMemory indexBufferMemory;
+MemoryAllocation indexBufferMemory;
+VkIndexType indexType = VK_INDEX_TYPE_UINT16;
+uint32_t maxIndexValue; // largest index the device draws, set with the device
+MeshRange meshes[MAX_MESHES];
+uint32_t meshCount;
+VkDrawIndexedIndirectCommand* drawCommands; // drawCount entries
+VkBuffer indirectBuffer; // device copy of drawCommands for --indirect
+MemoryAllocation indirectBufferMemory;
+uint32_t maxIndirectDraws; // commands one indirect call may read
+struct Instance* instanceData; // host copy, the culling bounds need it
+VkBuffer boundsBuffer;         // per draw bounds read by the culling pass
+MemoryAllocation boundsBufferMemory;
+VkBuffer visibleBuffer; // count and draws that survived culling
+MemoryAllocation visibleBufferMemory;
+VkDescriptorSetLayout cullSetLayout;
+VkDescriptorPool cullDescriptorPool;
+VkDescriptorSet cullDescriptorSet;
+VkPipelineLayout cullPipelineLayout;
+VkPipeline cullPipeline;
+ShaderReloader reloader;
+PipelineRegistry registry;
+UniformRing uniformRing;
+FrameData frameData;
+uint64_t sceneStartNs; // time 0 of the animation
+VkDescriptorSetLayout frameSetLayout;
+VkDescriptorPool frameDescriptorPool;
+VkDescriptorSet frameDescriptorSet;
+bool wireframeSupported; // fillModeNonSolid, set with the device
+bool viewModeRequested;  // V was pressed, cycled between frames
+MeshSource meshSources[MAX_MESHES]; // opened by openMeshes()
+uint32_t meshSourceCount;
+InitTask meshTask;
+InitTask pipelineTask;
+uint64_t startupNs; // initWindow() and initVulkan(), for the bench report
+double startupStageMs[STARTUP_STAGE_COUNT]; // of the latest startup()
+uint64_t startupMarkNs; // end of the latest timed stage
+VkBuffer instanceBuffer;
+MemoryAllocation instanceBufferMemory;
+VkPhysicalDeviceMemoryProperties memoryProperties;
+MemoryBlock memoryBlocks[ALLOCATOR_MAX_BLOCKS];
+uint32_t memoryBlockCount;
+UploadManager uploader;
+RecordPool recordPool;
 VkCommandBuffer commandBuffers[MAX_FRAMES_IN_FLIGHT];
+// --static-cmds only: the frame's commands recorded once per image, and the
+// timestamp writes around them recorded once per frame in flight
+VkCommandBuffer staticCommandBuffers[SWAPCHAIN_LENGTH];
+bool staticCommandsDirty[SWAPCHAIN_LENGTH];
+uint64_t imageTimelineValues[SWAPCHAIN_LENGTH]; // last frame to render it
+VkCommandBuffer timestampBeginCommandBuffers[MAX_FRAMES_IN_FLIGHT];
+VkCommandBuffer timestampEndCommandBuffers[MAX_FRAMES_IN_FLIGHT];
 VkSemaphore imageAvailableSemaphores[MAX_FRAMES_IN_FLIGHT];
 VkSemaphore renderFinishedSemaphores[MAX_FRAMES_IN_FLIGHT];
-VkFence inFlightFences[MAX_FRAMES_IN_FLIGHT];
+Timeline graphicsTimeline;
+Timeline transferTimeline; // dedicated transfer queue only
+uint64_t frameTimelineValues[MAX_FRAMES_IN_FLIGHT]; // slot's last submit
+VkQueryPool timestampQueryPools[MAX_FRAMES_IN_FLIGHT];
+bool timestampsWritten[MAX_FRAMES_IN_FLIGHT];
+bool timestampsSupported;
+double timestampPeriodNs; // nanoseconds per timestamp tick
+uint64_t timestampMask;   // timestamps only have timestampValidBits bits
 uint32_t currentFrame;
+bool frameWaited; // the current frame slot was already waited on
+uint64_t inputSampleNs; // when window events were last polled
 bool framebufferResized;
-
+uint64_t lastResizeNs; // time of the latest resize event
+DeletionQueue deletionQueue;
+// old swapchains waiting out their presents, see retireSwapChain()
+RetiredSwapChain* retiredSwapChains;
+size_t retiredSwapChainCount;
+size_t retiredSwapChainCapacity;
+
+int parseArgs(int argc, char** argv);
+static int parseUint64(const char* arg, uint64_t* value);
+void printUsage(const char* program);
 int run();
+int startup();
+int runStartupOnly();
+void writeStartupReport(FILE* out, double* samples, uint64_t runs);
+static void markStartupStage(StartupStage stage);
 int initWindow();
 static void framebufferResizeCallback(GLFWwindow* window, int width,
                                       int height);
+static void keyCallback(GLFWwindow* window, int key, int scancode, int action,
+                        int mods);
 int initVulkan();
+int initVulkanStages();
+int startInitTask(InitTask* task, int (*run)(), StartupStage stage);
+int joinInitTask(InitTask* task);
+int createPipelines();
 int createInstance();
 int createSurface();
 const char** getRequiredExtensions();
@@ -143,30 +795,117 @@ VkExtent2D chooseSwapExtent(const VkSurfaceCapabilitiesKHR* capabilities);
 uint32_t findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties);
 int createLogicalDevice();
 int createSwapChain();
+int createOffscreenTargets();
 int recreateSwapChain();
 int createImageViews();
 int createRenderPass();
+int createPipelineCache();
+int savePipelineCache();
 int createGraphicsPipeline();
-VkShaderModule createShaderModule(const char* code, size_t codeSize);
+int createPipelineRegistry();
+void describePipeline(ViewMode view, PipelineKey* key);
+VkPipeline getPipeline(const PipelineKey* key);
+void prefetchPipeline(const PipelineKey* key);
+int usePipeline(ViewMode view);
+void cycleViewMode();
+void replacePipelineShaders(ReloadedShaders* shaders);
+void destroyPipelineRegistry();
+VkShaderModule createShaderModule(const uint32_t* code, size_t codeSize);
 int createFrameBuffers();
 int createCommandPool();
+int initAllocator();
+int allocateMemory(const VkMemoryRequirements* requirements,
+                   VkMemoryPropertyFlags properties, AllocationKind kind,
+                   MemoryAllocation* allocation);
+void freeMemory(MemoryAllocation* allocation);
+AllocatorStats getAllocatorStats();
+void destroyAllocator();
 int createBuffer(VkDeviceSize size, VkBufferUsageFlags usage,
                  VkMemoryPropertyFlags properties, VkBuffer* buffer,
-                 VkDeviceMemory* bufferMemory);
-int createVertexBuffer();
-void copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size);
-int createIndexBuffer();
+                 MemoryAllocation* bufferMemory);
+void destroyBuffer(VkBuffer buffer, MemoryAllocation* bufferMemory);
+int createUploadManager();
+int uploadToBuffer(VkBuffer dstBuffer, VkDeviceSize dstOffset,
+                   const void* data, VkDeviceSize size, UploadTicket* ticket);
+int uploadReserve(VkBuffer dstBuffer, VkDeviceSize dstOffset,
+                  VkDeviceSize size, void** data, UploadTicket* ticket);
+int uploadFlush();
+bool uploadPoll(UploadTicket ticket);
+int uploadWait(UploadTicket ticket);
+void destroyUploadManager();
+int createUniformRing();
+void* uniformAlloc(VkDeviceSize size, uint32_t* dynamicOffset);
+int updateFrameData();
+int createFrameDescriptors();
+void destroyUniformRing();
+void quantizeVertices(const struct Vertex* src, struct PackedVertex* dst,
+                      size_t count);
+int createVertexBuffer(uint64_t count);
+int uploadVertices(const struct Vertex* data, uint64_t count,
+                   uint64_t firstVertex);
+int createIndexBuffer(VkIndexType type, uint64_t count);
+int uploadIndices(const void* data, uint32_t indexSize, uint64_t count,
+                  uint64_t vertexCount, uint64_t firstIndex);
+int openMeshSource(const char* path, MeshSource* source);
+void closeMeshSource(MeshSource* source);
+int createMeshBuffers(const MeshSource* sources, uint32_t count);
+int openMeshes();
+void closeMeshes();
+int loadMeshes();
+int createDrawCommands();
+int createCullPipeline();
+int createCullBuffers();
+int createCullDescriptors();
+int startShaderReloader();
+void swapReloadedPipeline();
+void stopShaderReloader();
+int createInstanceBuffer();
 int createCommandBuffers();
-int recordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t imageIndex);
+int recordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t imageIndex,
+                        VkQueryPool timestampPool);
+int recordInParallel(uint32_t imageIndex, VkQueryPool timestampPool);
+int createRecordWorkers();
+int createStaticCommandBuffers();
+void invalidateStaticCommands();
+int recordStaticCommandBuffer(uint32_t imageIndex);
+void destroyRecordWorkers();
+void deferDestroyBuffer(VkBuffer buffer, MemoryAllocation* bufferMemory);
+void deferFreeMemory(MemoryAllocation* allocation);
+void deferDestroyImageView(VkImageView imageView);
+void deferDestroyFramebuffer(VkFramebuffer frameBuffer);
+void deferDestroyPipeline(VkPipeline pipeline);
+void deferDestroySwapChain(VkSwapchainKHR swapChain);
+void retireSwapChain(VkSwapchainKHR swapChain);
+void countPresent();
+void destroyRetiredSwapChains();
+void collectDeletions();
+void flushDeletions();
+int createTimeline(Timeline* timeline);
+int waitTimeline(const Timeline* timeline, uint64_t value);
 int createSyncObjects();
+int createTimestampQueryPools();
+void readGpuTimings(uint32_t frame);
 int mainloop();
-int drawFrame();
+void waitForFrame();
+int drawFrame(bool* presented);
 void cleanup();
+int allocBenchSamples(uint64_t frameCount);
+void recordBenchSample(double frameMs);
+void writeBenchReport(FILE* out);
+void freeBenchSamples();
 static char* readFile(const char* fileName, size_t* fileSize);
+static inline uint64_t nowNs();
+static inline double elapsedMs(uint64_t startNs);
+Summary summarize(double* samples, size_t count);
+int compare_double(const void* a, const void* b);
 int compare_uint32_t(const void* a, const void* b);
 uint32_t removeDup(uint32_t arr[], size_t n);
 
-int main() {
+int main(int argc, char** argv) {
+    if (parseArgs(argc, argv) != 0) {
+        printUsage(argv[0]);
+        return 1;
+    }
 
     int err = run();
     if (err != 0) {
@@ -176,18 +915,326 @@ int main() {
     return 0;
 }
 
+int parseArgs(int argc, char** argv) {
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--headless") == 0) {
+            headless = true;
+        } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            if (parseUint64(argv[++i], &frameLimit) != 0) {
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--bench") == 0) {
+            bench = true;
+        } else if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc) {
+            if (parseUint64(argv[++i], &benchWarmup) != 0) {
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--instances") == 0 && i + 1 < argc) {
+            uint64_t count;
+            if (parseUint64(argv[++i], &count) != 0) {
+                return -1;
+            }
+            if (count == 0 || count > UINT32_MAX) {
+                fprintf(stderr, "ERROR: instance count out of range\n");
+                return -1;
+            }
+            instanceCount = (uint32_t)count;
+        } else if (strcmp(argv[i], "--draws") == 0 && i + 1 < argc) {
+            uint64_t count;
+            if (parseUint64(argv[++i], &count) != 0) {
+                return -1;
+            }
+            if (count == 0 || count > UINT32_MAX) {
+                fprintf(stderr, "ERROR: draw count out of range\n");
+                return -1;
+            }
+            drawCount = (uint32_t)count;
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            uint64_t count;
+            if (parseUint64(argv[++i], &count) != 0) {
+                return -1;
+            }
+            if (count > MAX_RECORD_THREADS) {
+                fprintf(stderr, "ERROR: at most %d recording threads\n",
+                        MAX_RECORD_THREADS);
+                return -1;
+            }
+            recordThreads = (uint32_t)count;
+        } else if (strcmp(argv[i], "--static-cmds") == 0) {
+            staticCommands = true;
+        } else if (strcmp(argv[i], "--mesh") == 0 && i + 1 < argc) {
+            if (meshPathCount == MAX_MESHES) {
+                fprintf(stderr, "ERROR: at most %d meshes\n", MAX_MESHES);
+                return -1;
+            }
+            meshPaths[meshPathCount++] = argv[++i];
+        } else if (strcmp(argv[i], "--packed-vertices") == 0) {
+            packedVertices = true;
+        } else if (strcmp(argv[i], "--optimize-mesh") == 0) {
+            optimizeMeshOnLoad = true;
+        } else if (strcmp(argv[i], "--indirect") == 0) {
+            indirectDraws = true;
+        } else if (strcmp(argv[i], "--cull") == 0) {
+            cullDraws = true;
+        } else if (strcmp(argv[i], "--hot-reload") == 0) {
+            hotReload = true;
+        } else if (strcmp(argv[i], "--serial-init") == 0) {
+            serialInit = true;
+        } else if (strcmp(argv[i], "--animate") == 0) {
+            animate = true;
+        } else if (strcmp(argv[i], "--startup-only") == 0 && i + 1 < argc) {
+            if (parseUint64(argv[++i], &startupRuns) != 0) {
+                return -1;
+            }
+            if (startupRuns == 0) {
+                fprintf(stderr, "ERROR: startup run count out of range\n");
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--spread") == 0 && i + 1 < argc) {
+            uint64_t spread;
+            if (parseUint64(argv[++i], &spread) != 0) {
+                return -1;
+            }
+            if (spread == 0 || spread > 1024) {
+                fprintf(stderr, "ERROR: spread out of range\n");
+                return -1;
+            }
+            sceneSpread = (uint32_t)spread;
+        } else if (strcmp(argv[i], "--pacing") == 0 && i + 1 < argc) {
+            ++i;
+            if (strcmp(argv[i], "low-latency") == 0) {
+                pacing = PACING_LOW_LATENCY;
+            } else if (strcmp(argv[i], "balanced") == 0) {
+                pacing = PACING_BALANCED;
+            } else if (strcmp(argv[i], "throughput") == 0) {
+                pacing = PACING_THROUGHPUT;
+            } else {
+                fprintf(stderr, "ERROR: unknown pacing mode '%s'\n", argv[i]);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--view") == 0 && i + 1 < argc) {
+            ++i;
+            int mode = 0;
+            while (mode < VIEW_MODE_COUNT &&
+                   strcmp(argv[i], viewModeNames[mode]) != 0) {
+                ++mode;
+            }
+            if (mode == VIEW_MODE_COUNT) {
+                fprintf(stderr, "ERROR: unknown view mode '%s'\n", argv[i]);
+                return -1;
+            }
+            viewMode = (ViewMode)mode;
+        } else if (strcmp(argv[i], "--bench-format") == 0 && i + 1 < argc) {
+            ++i;
+            if (strcmp(argv[i], "json") == 0) {
+                benchFormat = BENCH_FORMAT_JSON;
+            } else if (strcmp(argv[i], "csv") == 0) {
+                benchFormat = BENCH_FORMAT_CSV;
+            } else {
+                fprintf(stderr, "ERROR: unknown bench format '%s'\n",
+                        argv[i]);
+                return -1;
+            }
+        } else {
+            fprintf(stderr, "ERROR: unknown option '%s'\n", argv[i]);
+            return -1;
+        }
+    }
+
+    switch (pacing) {
+    case PACING_LOW_LATENCY:
+        framesInFlight = 1;
+        break;
+    case PACING_BALANCED:
+        framesInFlight = 2;
+        break;
+    case PACING_THROUGHPUT:
+        framesInFlight = 3;
+        break;
+    }
+
+    // worker command buffers are re-recorded every frame by design
+    if (staticCommands && recordThreads > 0) {
+        fprintf(stderr, "WARNING: --static-cmds records on the main thread, "
+                        "ignoring --threads\n");
+        recordThreads = 0;
+    }
+
+    // static command buffers bake the transform and the uniform offset
+    if (staticCommands && animate) {
+        fprintf(stderr, "WARNING: --static-cmds records the frame data "
+                        "once, ignoring --animate\n");
+        animate = false;
+    }
+
+    // culled draws are compacted into one list on the GPU, so they are
+    // drawn indirectly with a single call
+    if (cullDraws) {
+        indirectDraws = true;
+    }
+
+    // every draw covers at least one instance
+    if (drawCount > instanceCount) {
+        drawCount = instanceCount;
+    }
+
+    // benchmarks always need an end, even with a window
+    if ((headless || bench) && frameLimit == 0) {
+        frameLimit = HEADLESS_DEFAULT_FRAMES;
+    }
+
+    return 0;
+}
+
+static int parseUint64(const char* arg, uint64_t* value) {
+    char* end;
+    *value = strtoull(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0') {
+        fprintf(stderr, "ERROR: expected a number, got '%s'\n", arg);
+        return -1;
+    }
+    return 0;
+}
+
+void printUsage(const char* program) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  --headless            render offscreen without a window or "
+            "swapchain\n"
+            "  --frames N            exit after N frames (headless/bench "
+            "default: %d)\n"
+            "  --bench               time N frames and print a report on "
+            "exit\n"
+            "  --warmup N            frames to discard before measuring "
+            "(default: %d)\n"
+            "  --bench-format FMT    report as json (default) or csv\n"
+            "  --instances N         draw N quads (default: 1)\n"
+            "  --draws N             split the quads into N instanced draws "
+            "(default: 1)\n"
+            "  --threads N           record draws on N worker threads, 0 "
+            "records on the\n"
+            "                        main thread (default: 0)\n"
+            "  --static-cmds         record each swapchain image's commands "
+            "once and\n"
+            "                        reuse them until the swapchain changes\n"
+            "  --pacing MODE         low-latency, balanced (default) or "
+            "throughput\n"
+            "  --mesh FILE           draw a mesh converted by meshconv "
+            "instead of the quad,\n"
+            "                        repeat for more meshes, draw i uses "
+            "mesh i modulo\n"
+            "                        the mesh count\n"
+            "  --packed-vertices     store 8 byte snorm/unorm vertices "
+            "instead of floats\n"
+            "  --optimize-mesh       reorder the mesh for the vertex cache "
+            "while loading\n"
+            "  --indirect            read the draw list from a GPU buffer "
+            "with indirect draws\n"
+            "  --cull                drop draws outside the view in a "
+            "compute pass, implies\n"
+            "                        --indirect\n"
+            "  --spread N            spread the instances over N by N "
+            "viewports (default: 1)\n"
+            "  --hot-reload          rebuild the pipeline when a shader in "
+            SHADER_DIR " changes,\n"
+            "                        run from the repository root\n"
+            "  --serial-init         run every startup stage on the main "
+            "thread\n"
+            "  --animate             rotate the scene and pulse its "
+            "colors\n"
+            "  --view MODE           shaded (default), wireframe or "
+            "overdraw, V cycles them\n"
+            "  --startup-only N      initialize and tear down N times "
+            "without rendering,\n"
+            "                        then print a startup time report\n",
+            program, HEADLESS_DEFAULT_FRAMES, BENCH_DEFAULT_WARMUP);
+}
+
 int run() {
-    if (initWindow() != 0) {
-        exit(1);
+    if (startupRuns > 0) {
+        return runStartupOnly();
     }
-    if (initVulkan() != 0) {
+
+    if (startup() != 0) {
         exit(1);
     };
+    if (bench && allocBenchSamples(frameLimit) != 0) {
+        exit(1);
+    }
     mainloop();
+    if (bench) {
+        writeBenchReport(stdout);
+        freeBenchSamples();
+    }
     cleanup();
     return 0;
 }
 
+// initWindow() and initVulkan(), timing every stage into startupStageMs.
+int startup() {
+    memset(startupStageMs, 0, sizeof(startupStageMs));
+    uint64_t start = nowNs();
+    startupMarkNs = start;
+
+    if (!headless && initWindow() != 0) {
+        // no display available, still render so the frame loop can be
+        // exercised on build machines
+        fprintf(stderr, "WARNING: falling back to headless rendering\n");
+        headless = true;
+        if (frameLimit == 0) {
+            frameLimit = HEADLESS_DEFAULT_FRAMES;
+        }
+    }
+    markStartupStage(STARTUP_WINDOW);
+
+    if (initVulkan() != 0) {
+        return -1;
+    }
+    startupNs = nowNs() - start;
+    return 0;
+}
+
+// Adds the time since the previous mark to stage.
+static void markStartupStage(StartupStage stage) {
+    uint64_t now = nowNs();
+    startupStageMs[stage] += (double)(now - startupMarkNs) / 1e6;
+    startupMarkNs = now;
+}
+
+// --startup-only: the first run pays for loading the driver and filling the
+// pipeline cache, the others show the warm startup time.
+int runStartupOnly() {
+    // per run: every stage, then the total, then the teardown
+    size_t columns = STARTUP_STAGE_COUNT + 2;
+    double* samples = calloc(columns * startupRuns, sizeof(double));
+    if (samples == NULL) {
+        fprintf(stderr, "ERROR: failed to allocate startup samples\n");
+        return 1;
+    }
+
+    for (uint64_t run = 0; run < startupRuns; ++run) {
+        if (startup() != 0) {
+            free(samples);
+            exit(1);
+        }
+        vkDeviceWaitIdle(device);
+        uint64_t teardownStart = nowNs();
+        cleanup();
+
+        for (size_t stage = 0; stage < STARTUP_STAGE_COUNT; ++stage) {
+            samples[stage * startupRuns + run] = startupStageMs[stage];
+        }
+        samples[STARTUP_STAGE_COUNT * startupRuns + run] =
+            (double)startupNs / 1e6;
+        samples[(STARTUP_STAGE_COUNT + 1) * startupRuns + run] =
+            elapsedMs(teardownStart);
+    }
+
+    writeStartupReport(stdout, samples, startupRuns);
+    free(samples);
+    return 0;
+}
+
 int initWindow() {
     if (glfwInit() == GLFW_FALSE) {
         fprintf(stderr, "WARNING: Failed to initialize libglfw\n");
@@ -198,7 +1245,13 @@ int initWindow() {
     glfwWindowHint(GLFW_RESIZABLE, GLFW_TRUE);
 
     window = glfwCreateWindow(WIDTH, HEIGHT, "Vulkan", NULL, NULL);
+    if (window == NULL) {
+        fprintf(stderr, "WARNING: Failed to create window\n");
+        glfwTerminate();
+        return -1;
+    }
     glfwSetWindowSizeCallback(window, framebufferResizeCallback);
+    glfwSetKeyCallback(window, keyCallback);
 
     return 0;
 }
@@ -208,9 +1261,83 @@ static void framebufferResizeCallback(__attribute__((unused))
                                       __attribute__((unused)) int width,
                                       __attribute__((unused)) int height) {
     framebufferResized = true;
+    lastResizeNs = nowNs();
+}
+
+static void keyCallback(__attribute__((unused)) GLFWwindow* window, int key,
+                        __attribute__((unused)) int scancode, int action,
+                        __attribute__((unused)) int mods) {
+    if (key == GLFW_KEY_V && action == GLFW_PRESS) {
+        viewModeRequested = true;
+    }
+}
+
+// Only the task writes its stage's time, which is read after the join.
+static void* initTaskMain(void* arg) {
+    InitTask* task = arg;
+    uint64_t start = nowNs();
+    task->result = task->run();
+    startupStageMs[task->stage] = elapsedMs(start);
+    return NULL;
+}
+
+// Runs run() on a new thread, or right away with --serial-init or if no
+// thread can be created. Returns run()'s result in that case, 0 otherwise.
+int startInitTask(InitTask* task, int (*run)(), StartupStage stage) {
+    *task = (InitTask){.run = run, .stage = stage};
+    if (!serialInit &&
+        pthread_create(&task->thread, NULL, initTaskMain, task) == 0) {
+        task->started = true;
+        return 0;
+    }
+    uint64_t start = nowNs();
+    initTaskMain(task);
+    // keep the inline run out of the main thread's current stage
+    startupMarkNs += nowNs() - start;
+    return task->result;
+}
+
+// Waits for the task if it is still running, safe to call again.
+int joinInitTask(InitTask* task) {
+    if (task->started) {
+        pthread_join(task->thread, NULL);
+        task->started = false;
+    }
+    return task->result;
+}
+
+// The graphics pipeline and the culling pipeline next to it, compiled while
+// the main thread creates the framebuffers and uploads the geometry.
+int createPipelines() {
+    if (createGraphicsPipeline() != 0) {
+        fprintf(stderr, "ERROR: failed to create graphics pipeline\n");
+        return -1;
+    }
+    if (cullDraws && createCullPipeline() != 0) {
+        fprintf(stderr, "ERROR: failed to create culling pipeline\n");
+        return -1;
+    }
+    return 0;
 }
 
 int initVulkan() {
+    int result = initVulkanStages();
+
+    // a failed stage returns without waiting for the tasks
+    joinInitTask(&pipelineTask);
+    joinInitTask(&meshTask);
+    closeMeshes();
+    return result;
+}
+
+// Mesh files are read and optimized on one task from the start, pipelines
+// are compiled on another once the render pass exists. The main thread
+// joins each task right before the first stage that needs its result.
+int initVulkanStages() {
+
+    if (startInitTask(&meshTask, openMeshes, STARTUP_MESH_FILES_TASK) != 0) {
+        return -1;
+    }
 
     if (enableValidationLayers && !checkValidationLayerSupport()) {
         fprintf(stderr,
@@ -222,39 +1349,69 @@ int initVulkan() {
         fprintf(stderr, "ERROR: failed to create vulkan instance\n");
         return -1;
     }
+    markStartupStage(STARTUP_INSTANCE);
 
-    if (createSurface() != 0) {
+    if (!headless && createSurface() != 0) {
         fprintf(stderr, "ERROR: failed to create vulkan surface\n");
         return -1;
     }
+    markStartupStage(STARTUP_SURFACE);
 
     if (pickPhysicalDevice() != 0) {
         fprintf(stderr, "ERROR: failed to pick physical device\n");
         return -1;
     }
+    markStartupStage(STARTUP_PHYSICAL_DEVICE);
 
     if (createLogicalDevice() != 0) {
         fprintf(stderr, "ERROR: failed to create logical device\n");
         return -1;
     }
+    markStartupStage(STARTUP_LOGICAL_DEVICE);
 
-    if (createSwapChain() != 0) {
-        fprintf(stderr, "ERROR: failed to create swap chain\n");
+    if (initAllocator() != 0) {
+        fprintf(stderr, "ERROR: failed to initialize memory allocator\n");
         return -1;
     }
 
-    if (createImageViews() != 0) {
-        fprintf(stderr, "ERROR: failed to create image views\n");
+    if (createTimeline(&graphicsTimeline) != 0 ||
+        (transferQueueFamily != graphicsQueueFamily &&
+         createTimeline(&transferTimeline) != 0)) {
+        fprintf(stderr, "ERROR: failed to create timeline semaphores\n");
+        return -1;
+    }
+    markStartupStage(STARTUP_ALLOCATOR);
+
+    if (headless) {
+        if (createOffscreenTargets() != 0) {
+            fprintf(stderr, "ERROR: failed to create offscreen targets\n");
+            return -1;
+        }
+    } else if (createSwapChain() != 0) {
+        fprintf(stderr, "ERROR: failed to create swap chain\n");
         return -1;
     }
+    markStartupStage(STARTUP_SWAPCHAIN);
 
     if (createRenderPass() != 0) {
         fprintf(stderr, "ERROR: failed to create render pass\n");
         return -1;
     }
+    markStartupStage(STARTUP_RENDER_PASS);
 
-    if (createGraphicsPipeline() != 0) {
-        fprintf(stderr, "ERROR: failed to create graphics pipeline\n");
+    if (createPipelineCache() != 0) {
+        fprintf(stderr, "ERROR: failed to create pipeline cache\n");
+        return -1;
+    }
+    markStartupStage(STARTUP_PIPELINE_CACHE);
+
+    if (startInitTask(&pipelineTask, createPipelines,
+                      STARTUP_PIPELINES_TASK) != 0) {
+        return -1;
+    }
+
+    if (createImageViews() != 0) {
+        fprintf(stderr, "ERROR: failed to create image views\n");
         return -1;
     }
 
@@ -262,32 +1419,106 @@ int initVulkan() {
         fprintf(stderr, "ERROR: failed to create frame buffers\n");
         return -1;
     }
+    markStartupStage(STARTUP_FRAMEBUFFERS);
 
     if (createCommandPool() != 0) {
         fprintf(stderr, "ERROR: failed to create command pool\n");
         return -1;
     }
 
-    if (createVertexBuffer() != 0) {
-        fprintf(stderr, "ERROR: failed to create vertex buffers\n");
+    if (createUploadManager() != 0) {
+        fprintf(stderr, "ERROR: failed to create upload manager\n");
+        return -1;
+    }
+    markStartupStage(STARTUP_COMMAND_POOL);
+
+    if (createUniformRing() != 0) {
+        fprintf(stderr, "ERROR: failed to create uniform ring\n");
+        return -1;
+    }
+    markStartupStage(STARTUP_UNIFORM_RING);
+
+    if (joinInitTask(&meshTask) != 0 || loadMeshes() != 0) {
+        fprintf(stderr, "ERROR: failed to create vertex and index buffers\n");
+        return -1;
+    }
+    markStartupStage(STARTUP_MESH_BUFFERS);
+
+    if (createInstanceBuffer() != 0) {
+        fprintf(stderr, "ERROR: failed to create instance buffers\n");
         return -1;
     }
 
-    if (createIndexBuffer() != 0) {
-        fprintf(stderr, "ERROR: failed to create index buffers\n");
+    if (createDrawCommands() != 0) {
+        fprintf(stderr, "ERROR: failed to create draw commands\n");
         return -1;
     }
 
+    if (cullDraws && createCullBuffers() != 0) {
+        fprintf(stderr, "ERROR: failed to create culling buffers\n");
+        return -1;
+    }
+    markStartupStage(STARTUP_DRAW_DATA);
+
+    // all geometry goes out in one submit, ordered before the first frame
+    if (uploadFlush() != 0) {
+        fprintf(stderr, "ERROR: failed to submit uploads\n");
+        return -1;
+    }
+    markStartupStage(STARTUP_UPLOAD_FLUSH);
+
     if (createCommandBuffers() != 0) {
         fprintf(stderr, "ERROR: failed to create command buffer\n");
         return -1;
     }
 
+    if (createRecordWorkers() != 0) {
+        fprintf(stderr, "ERROR: failed to create recording threads\n");
+        return -1;
+    }
+    markStartupStage(STARTUP_COMMAND_BUFFERS);
+
     if (createSyncObjects() != 0) {
         fprintf(stderr, "ERROR: failed to create sync objects\n");
         return -1;
     }
 
+    if (createTimestampQueryPools() != 0) {
+        fprintf(stderr, "ERROR: failed to create timestamp query pools\n");
+        return -1;
+    }
+    markStartupStage(STARTUP_SYNC_OBJECTS);
+
+    if (joinInitTask(&pipelineTask) != 0) {
+        return -1;
+    }
+    markStartupStage(STARTUP_PIPELINE_WAIT);
+
+    if (createFrameDescriptors() != 0) {
+        fprintf(stderr, "ERROR: failed to create frame descriptors\n");
+        return -1;
+    }
+    markStartupStage(STARTUP_FRAME_DESCRIPTORS);
+
+    if (cullDraws && createCullDescriptors() != 0) {
+        fprintf(stderr, "ERROR: failed to create culling descriptors\n");
+        return -1;
+    }
+    markStartupStage(STARTUP_CULL_DESCRIPTORS);
+
+    if (staticCommands && createStaticCommandBuffers() != 0) {
+        fprintf(stderr, "ERROR: failed to create static command buffers\n");
+        return -1;
+    }
+    markStartupStage(STARTUP_STATIC_COMMANDS);
+
+    if (hotReload && startShaderReloader() != 0) {
+        fprintf(stderr, "ERROR: failed to start shader hot reload\n");
+        hotReload = false; // nothing for cleanup() to stop
+        return -1;
+    }
+    markStartupStage(STARTUP_SHADER_RELOADER);
+
     return 0;
 }
 
@@ -299,12 +1530,14 @@ int createInstance() {
         .applicationVersion = VK_MAKE_VERSION(1, 0, 0),
         .pEngineName = "No Engine",
         .engineVersion = VK_MAKE_VERSION(1, 0, 0),
-        .apiVersion = VK_API_VERSION_1_0,
+        .apiVersion = VK_API_VERSION_1_2,
     };
 
+    // headless rendering needs no window system integration extensions
     uint32_t glfwExtensionCount = 0;
     const char* const* glfwExtensions =
-        glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+        headless ? NULL
+                 : glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
 
     VkInstanceCreateInfo createInfo = {
         .sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO,
@@ -327,7 +1560,8 @@ int createInstance() {
         return -1;
     }
 
-    if (!checkRequiredGLFWExtensions(glfwExtensionCount, glfwExtensions)) {
+    if (!headless &&
+        !checkRequiredGLFWExtensions(glfwExtensionCount, glfwExtensions)) {
         fprintf(stderr, "ERROR: Failed to find required extensions\n");
         return -1;
     }
@@ -463,22 +1697,41 @@ int rateDeviceSuitability(VkPhysicalDevice device) {
         return 0;
     }
 
-    QueueFamilyIndices indices = findQueueFamilies(device);
-    if (!isComplete(indices)) {
+    // frames and uploads are tracked with timeline semaphores
+    VkPhysicalDeviceVulkan12Features vulkan12Features = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES,
+    };
+    VkPhysicalDeviceFeatures2 features2 = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+        .pNext = &vulkan12Features,
+    };
+    if (deviceProperties.apiVersion < VK_API_VERSION_1_2) {
         return 0;
     }
-
-    if (!checkDeviceExtensionSupport(device)) {
+    vkGetPhysicalDeviceFeatures2(device, &features2);
+    if (!vulkan12Features.timelineSemaphore) {
         return 0;
     }
 
-    // only query swap chain support after checking extensions
-    SwapChainSupportDetails swapChainSupport = querySwapChainSupport(device);
-    if (swapChainSupport.formats == NULL ||
-        swapChainSupport.presentModes == NULL) {
+    QueueFamilyIndices indices = findQueueFamilies(device);
+    if (!isComplete(indices)) {
         return 0;
     }
 
+    if (!headless) {
+        if (!checkDeviceExtensionSupport(device)) {
+            return 0;
+        }
+
+        // only query swap chain support after checking extensions
+        SwapChainSupportDetails swapChainSupport =
+            querySwapChainSupport(device);
+        if (swapChainSupport.formats == NULL ||
+            swapChainSupport.presentModes == NULL) {
+            return 0;
+        }
+    }
+
     if (deviceProperties.deviceType == VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU) {
         score += 1000;
     }
@@ -518,6 +1771,7 @@ QueueFamilyIndices findQueueFamilies(VkPhysicalDevice device) {
     QueueFamilyIndices indices = {
         .graphicsFamily = {false, 0},
         .presentFamily = {false, 0},
+        .transferFamily = {false, 0},
     };
 
     uint32_t queueFamilyCount = 0;
@@ -533,9 +1787,12 @@ QueueFamilyIndices findQueueFamilies(VkPhysicalDevice device) {
             indices.graphicsFamily.value = i;
         }
 
-        VkBool32 presentSupport = false;
-        vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface,
-                                             &presentSupport);
+        // nothing is presented in headless mode, so any family will do
+        VkBool32 presentSupport = headless;
+        if (!headless) {
+            vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface,
+                                                 &presentSupport);
+        }
         if (presentSupport) {
             indices.presentFamily.is_present = true;
             indices.presentFamily.value = i;
@@ -546,6 +1803,22 @@ QueueFamilyIndices findQueueFamilies(VkPhysicalDevice device) {
         }
     }
 
+    // prefer a transfer-only family, usually a DMA engine, so uploads run
+    // alongside rendering instead of taking graphics queue time
+    for (size_t i = 0; i < queueFamilyCount; ++i) {
+        VkQueueFlags flags = queueFamilies[i].queueFlags;
+        if ((flags & VK_QUEUE_TRANSFER_BIT) &&
+            !(flags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT))) {
+            indices.transferFamily.is_present = true;
+            indices.transferFamily.value = i;
+            break;
+        }
+    }
+    if (!indices.transferFamily.is_present) {
+        indices.transferFamily.is_present = indices.graphicsFamily.is_present;
+        indices.transferFamily.value = indices.graphicsFamily.value;
+    }
+
     return indices;
 }
 
@@ -591,15 +1864,41 @@ VkSurfaceFormatKHR chooseSwapSurfaceFormat(VkSurfaceFormatKHR* availableFormats,
     return availableFormats[0];
 }
 
+// Picks the first available mode in the pacing mode's preference list, FIFO
+// is the fallback since every device supports it.
 VkPresentModeKHR chooseSwapPresentMode(VkPresentModeKHR* availablePresentModes,
                                        size_t presentModeCount) {
-    for (size_t i = 0; i < presentModeCount; ++i) {
-        if (availablePresentModes[i] == VK_PRESENT_MODE_MAILBOX_KHR) {
-            return availablePresentModes[i];
-        }
+    static const VkPresentModeKHR lowLatencyModes[] = {
+        VK_PRESENT_MODE_IMMEDIATE_KHR, VK_PRESENT_MODE_MAILBOX_KHR};
+    static const VkPresentModeKHR balancedModes[] = {
+        VK_PRESENT_MODE_MAILBOX_KHR};
+    static const VkPresentModeKHR throughputModes[] = {
+        VK_PRESENT_MODE_MAILBOX_KHR, VK_PRESENT_MODE_IMMEDIATE_KHR};
+
+    const VkPresentModeKHR* preferredModes = balancedModes;
+    size_t preferredModeCount = 1;
+    switch (pacing) {
+    case PACING_LOW_LATENCY:
+        preferredModes = lowLatencyModes;
+        preferredModeCount = 2;
+        break;
+    case PACING_BALANCED:
+        break;
+    case PACING_THROUGHPUT:
+        preferredModes = throughputModes;
+        preferredModeCount = 2;
+        break;
     }
 
-    return VK_PRESENT_MODE_FIFO_KHR;
+    for (size_t j = 0; j < preferredModeCount; ++j) {
+        for (size_t i = 0; i < presentModeCount; ++i) {
+            if (availablePresentModes[i] == preferredModes[j]) {
+                return availablePresentModes[i];
+            }
+        }
+    }
+
+    return VK_PRESENT_MODE_FIFO_KHR;
 }
 
 VkExtent2D chooseSwapExtent(const VkSurfaceCapabilitiesKHR* capabilities) {
@@ -630,8 +1929,9 @@ int createLogicalDevice() {
     assert(indices.graphicsFamily.is_present);
     assert(indices.presentFamily.is_present);
 
-    uint32_t queueFamilies[2] = {indices.graphicsFamily.value,
-                                 indices.presentFamily.value};
+    uint32_t queueFamilies[3] = {indices.graphicsFamily.value,
+                                 indices.presentFamily.value,
+                                 indices.transferFamily.value};
     uint32_t queueFamiliesLength =
         sizeof(queueFamilies) / sizeof(queueFamilies[0]);
 
@@ -641,7 +1941,7 @@ int createLogicalDevice() {
     uint32_t uniqueQueueFamiliesLength =
         removeDup(queueFamilies, queueFamiliesLength);
 
-    VkDeviceQueueCreateInfo uniqueQueueFamilies[uniqueQueueFamiliesLength] = {};
+    VkDeviceQueueCreateInfo uniqueQueueFamilies[uniqueQueueFamiliesLength];
 
     float queuePriority = 1.0f;
     for (size_t i = 0; i < uniqueQueueFamiliesLength; ++i) {
@@ -656,15 +1956,76 @@ int createLogicalDevice() {
         uniqueQueueFamilies[i] = queueCreateInfo;
     }
 
-    VkPhysicalDeviceFeatures deviceFeatures = {};
+    // without fullDrawIndexUint32 32 bit indices stop at
+    // maxDrawIndexedIndexValue, at least 2^24 - 1
+    VkPhysicalDeviceVulkan12Features supported12 = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES,
+    };
+    VkPhysicalDeviceFeatures2 supported = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+        .pNext = &supported12,
+    };
+    VkPhysicalDeviceProperties deviceProperties;
+    vkGetPhysicalDeviceFeatures2(physicalDevice, &supported);
+    vkGetPhysicalDeviceProperties(physicalDevice, &deviceProperties);
+    VkPhysicalDeviceFeatures supportedFeatures = supported.features;
+    maxIndexValue = supportedFeatures.fullDrawIndexUint32
+                        ? UINT32_MAX
+                        : deviceProperties.limits.maxDrawIndexedIndexValue;
+
+    // indirect commands can only start past instance 0 with
+    // drawIndirectFirstInstance
+    if (indirectDraws && !supportedFeatures.drawIndirectFirstInstance) {
+        fprintf(stderr, "WARNING: drawIndirectFirstInstance is not supported, "
+                        "using direct draws\n");
+        indirectDraws = false;
+    }
+    maxIndirectDraws = supportedFeatures.multiDrawIndirect
+                           ? deviceProperties.limits.maxDrawIndirectCount
+                           : 1;
+    wireframeSupported = supportedFeatures.fillModeNonSolid;
+    if (viewMode == VIEW_WIREFRAME && !wireframeSupported) {
+        fprintf(stderr, "WARNING: fillModeNonSolid is not supported, "
+                        "using the shaded view\n");
+        viewMode = VIEW_SHADED;
+    }
+    // the visible list is drawn with one count call
+    if (cullDraws && (!indirectDraws || !supported12.drawIndirectCount ||
+                      drawCount > maxIndirectDraws)) {
+        fprintf(stderr, "WARNING: culling needs drawIndirectCount and room "
+                        "for every draw in one call, drawing everything\n");
+        cullDraws = false;
+    }
+    // decided here rather than in parseArgs so --threads still applies when
+    // culling falls back to drawing everything
+    if (cullDraws && recordThreads > 0) {
+        fprintf(stderr, "WARNING: --cull records on the main thread, "
+                        "ignoring --threads\n");
+        recordThreads = 0;
+    }
+
+    VkPhysicalDeviceFeatures deviceFeatures = {
+        .fullDrawIndexUint32 = supportedFeatures.fullDrawIndexUint32,
+        .multiDrawIndirect = supportedFeatures.multiDrawIndirect,
+        .drawIndirectFirstInstance =
+            supportedFeatures.drawIndirectFirstInstance,
+        .fillModeNonSolid = supportedFeatures.fillModeNonSolid,
+    };
+    VkPhysicalDeviceVulkan12Features vulkan12Features = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES,
+        .timelineSemaphore = VK_TRUE,
+        .drawIndirectCount = cullDraws,
+    };
 
     VkDeviceCreateInfo createInfo = {
         .sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
+        .pNext = &vulkan12Features,
         .pQueueCreateInfos = uniqueQueueFamilies,
-        .queueCreateInfoCount = 1,
+        .queueCreateInfoCount = uniqueQueueFamiliesLength,
         .pEnabledFeatures = &deviceFeatures,
         .enabledExtensionCount =
-            sizeof(deviceExtensions) / sizeof(deviceExtensions[0]),
+            headless ? 0
+                     : sizeof(deviceExtensions) / sizeof(deviceExtensions[0]),
         .ppEnabledExtensionNames = deviceExtensions};
 
     if (vkCreateDevice(physicalDevice, &createInfo, NULL, &device) !=
@@ -675,6 +2036,9 @@ int createLogicalDevice() {
 
     vkGetDeviceQueue(device, indices.graphicsFamily.value, 0, &graphicsQueue);
     vkGetDeviceQueue(device, indices.presentFamily.value, 0, &presentQueue);
+    vkGetDeviceQueue(device, indices.transferFamily.value, 0, &transferQueue);
+    graphicsQueueFamily = indices.graphicsFamily.value;
+    transferQueueFamily = indices.transferFamily.value;
 
     return 0;
 }
@@ -690,6 +2054,10 @@ int createSwapChain() {
     VkExtent2D extent = chooseSwapExtent(&swapChainSupport.capabilities);
 
     uint32_t imageCount = swapChainSupport.capabilities.minImageCount + 1;
+    // every frame in flight can hold an image while another is displayed
+    if (imageCount < framesInFlight + 1) {
+        imageCount = framesInFlight + 1;
+    }
     if (swapChainSupport.capabilities.maxImageCount > 0 &&
         imageCount > swapChainSupport.capabilities.maxImageCount) {
         imageCount = swapChainSupport.capabilities.maxImageCount;
@@ -708,7 +2076,9 @@ int createSwapChain() {
         .compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR,
         .presentMode = presentMode,
         .clipped = VK_TRUE,
-        .oldSwapchain = VK_NULL_HANDLE,
+        // null on first creation, otherwise the swapchain being replaced,
+        // which lets the presentation engine hand its resources over
+        .oldSwapchain = swapChain,
     };
 
     QueueFamilyIndices indices = findQueueFamilies(physicalDevice);
@@ -744,14 +2114,78 @@ int createSwapChain() {
     return 0;
 }
 
+// Stands in for createSwapChain when there is no surface to present to.
+// The images are never presented so they are left in TRANSFER_SRC layout,
+// ready to be read back.
+int createOffscreenTargets() {
+    swapChainImageFormat = VK_FORMAT_R8G8B8A8_UNORM;
+    swapChainExtent = (VkExtent2D){WIDTH, HEIGHT};
+    // one offscreen target per frame in flight
+    swapChainImageCount = framesInFlight;
+
+    for (size_t i = 0; i < swapChainImageCount; ++i) {
+        VkImageCreateInfo imageInfo = {
+            .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+            .imageType = VK_IMAGE_TYPE_2D,
+            .format = swapChainImageFormat,
+            .extent = {swapChainExtent.width, swapChainExtent.height, 1},
+            .mipLevels = 1,
+            .arrayLayers = 1,
+            .samples = VK_SAMPLE_COUNT_1_BIT,
+            .tiling = VK_IMAGE_TILING_OPTIMAL,
+            .usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |
+                     VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+            .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+            .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+        };
+        if (vkCreateImage(device, &imageInfo, NULL, &swapChainImages[i]) !=
+            VK_SUCCESS) {
+            fprintf(stderr, "ERROR: failed to create offscreen image %lu\n",
+                    i);
+            return -1;
+        }
+
+        VkMemoryRequirements memoryRequirements;
+        vkGetImageMemoryRequirements(device, swapChainImages[i],
+                                     &memoryRequirements);
+        if (allocateMemory(&memoryRequirements,
+                           VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                           ALLOCATION_OPTIMAL,
+                           &offscreenImageMemory[i]) != 0) {
+            fprintf(stderr,
+                    "ERROR: failed to allocate offscreen image memory\n");
+            return -1;
+        }
+
+        vkBindImageMemory(device, swapChainImages[i],
+                          offscreenImageMemory[i].memory,
+                          offscreenImageMemory[i].offset);
+    }
+
+    return 0;
+}
+
 void cleanupSwapChain() {
     for (size_t i = 0; i < swapChainImageCount; ++i) {
         vkDestroyFramebuffer(device, swapChainFrameBuffers[i], NULL);
         vkDestroyImageView(device, swapChainImageViews[i], NULL);
     }
-    vkDestroySwapchainKHR(device, swapChain, NULL);
+
+    if (headless) {
+        for (size_t i = 0; i < swapChainImageCount; ++i) {
+            vkDestroyImage(device, swapChainImages[i], NULL);
+            freeMemory(&offscreenImageMemory[i]);
+        }
+    } else {
+        vkDestroySwapchainKHR(device, swapChain, NULL);
+        // not an oldSwapchain for the next startup with --startup-only
+        swapChain = VK_NULL_HANDLE;
+    }
 }
 
+// Replaces the swapchain without draining the GPU. Frames in flight keep
+// the old views and framebuffers alive until they finish, the old swapchain
+// also waits out its presents, see retireSwapChain().
 int recreateSwapChain() {
     int width = 0, height = 0;
     glfwGetFramebufferSize(window, &width, &height);
@@ -759,11 +2193,20 @@ int recreateSwapChain() {
         glfwGetFramebufferSize(window, &width, &height);
         glfwWaitEvents();
     }
-    vkDeviceWaitIdle(device);
-    cleanupSwapChain();
-    createSwapChain();
-    createImageViews();
-    createFrameBuffers();
+
+    for (size_t i = 0; i < swapChainImageCount; ++i) {
+        deferDestroyFramebuffer(swapChainFrameBuffers[i]);
+        deferDestroyImageView(swapChainImageViews[i]);
+    }
+    // createSwapChain still needs the handle as oldSwapchain, retiring it
+    // first is fine since nothing is destroyed before the next present
+    retireSwapChain(swapChain);
+
+    if (createSwapChain() != 0 || createImageViews() != 0 ||
+        createFrameBuffers() != 0) {
+        return -1;
+    }
+    invalidateStaticCommands();
     return 0;
 }
 
@@ -808,7 +2251,8 @@ int createRenderPass() {
         .stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
         .stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
         .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
-        .finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+        .finalLayout = headless ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL
+                                : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
     };
 
     VkAttachmentReference colorAttatchmentRef = {
@@ -848,39 +2292,151 @@ int createRenderPass() {
     return 0;
 }
 
-int createGraphicsPipeline() {
-    size_t vertShaderSize;
-    size_t fragShaderSize;
-    char* vertShaderCode = readFile("src/shaders/vert.spv", &vertShaderSize);
-    char* fragShaderCode = readFile("src/shaders/frag.spv", &fragShaderSize);
+// Returns true if the cache data was written by this driver and device, a
+// mismatched cache would be rejected or ignored by the driver anyway.
+static bool isPipelineCacheCompatible(const char* data, size_t size) {
+    VkPipelineCacheHeaderVersionOne header;
+    if (size < sizeof(header)) {
+        return false;
+    }
+    memcpy(&header, data, sizeof(header));
+
+    VkPhysicalDeviceProperties deviceProperties;
+    vkGetPhysicalDeviceProperties(physicalDevice, &deviceProperties);
+
+    return header.headerSize >= sizeof(header) && header.headerSize <= size &&
+           header.headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+           header.vendorID == deviceProperties.vendorID &&
+           header.deviceID == deviceProperties.deviceID &&
+           memcmp(header.pipelineCacheUUID, deviceProperties.pipelineCacheUUID,
+                  VK_UUID_SIZE) == 0;
+}
+
+int createPipelineCache() {
+    char* cacheData = NULL;
+    size_t cacheSize = 0;
+
+    // a missing cache is expected on the first run
+    if (access(PIPELINE_CACHE_PATH, R_OK) == 0) {
+        cacheData = readFile(PIPELINE_CACHE_PATH, &cacheSize);
+        if (cacheData != NULL &&
+            !isPipelineCacheCompatible(cacheData, cacheSize)) {
+            fprintf(stderr, "WARNING: ignoring stale pipeline cache %s\n",
+                    PIPELINE_CACHE_PATH);
+            free(cacheData);
+            cacheData = NULL;
+            cacheSize = 0;
+        }
+    }
+
+    VkPipelineCacheCreateInfo cacheInfo = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+        .initialDataSize = cacheSize,
+        .pInitialData = cacheData,
+    };
+    VkResult result =
+        vkCreatePipelineCache(device, &cacheInfo, NULL, &pipelineCache);
+    free(cacheData);
+
+    if (result != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to create pipeline cache\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+// Writes to a temporary file first and renames it over the old cache, so an
+// interrupted write never leaves a truncated cache behind.
+int savePipelineCache() {
+    size_t cacheSize = 0;
+    if (vkGetPipelineCacheData(device, pipelineCache, &cacheSize, NULL) !=
+        VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to query pipeline cache size\n");
+        return -1;
+    }
+
+    char* cacheData = malloc(cacheSize);
+    if (cacheData == NULL) {
+        fprintf(stderr, "ERROR: failed to allocate pipeline cache data\n");
+        return -1;
+    }
+    if (vkGetPipelineCacheData(device, pipelineCache, &cacheSize,
+                               cacheData) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to read pipeline cache data\n");
+        free(cacheData);
+        return -1;
+    }
+
+    const char* tmpPath = PIPELINE_CACHE_PATH ".tmp";
+    FILE* fp = fopen(tmpPath, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "ERROR: couldn't open file %s\n", tmpPath);
+        free(cacheData);
+        return -1;
+    }
 
-    if (vertShaderCode == NULL) {
-        fprintf(stderr, "ERROR: failed to read vertex shader\n");
+    bool written = fwrite(cacheData, 1, cacheSize, fp) == cacheSize &&
+                   fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    written = fclose(fp) == 0 && written;
+    free(cacheData);
+
+    if (!written || rename(tmpPath, PIPELINE_CACHE_PATH) != 0) {
+        fprintf(stderr, "ERROR: failed to write pipeline cache %s\n",
+                PIPELINE_CACHE_PATH);
+        remove(tmpPath);
         return -1;
     }
-    if (fragShaderCode == NULL) {
-        fprintf(stderr, "ERROR: failed to read fragment shader\n");
+
+    return 0;
+}
+
+// Builds the graphics pipeline from the given SPIR-V with pipelineLayout.
+// Only reads state that is fixed after startup, so it may run on the shader
+// reload thread.
+static int buildGraphicsPipeline(const PipelineKey* key,
+                                 const uint32_t* vertCode, size_t vertSize,
+                                 const uint32_t* fragCode, size_t fragSize,
+                                 VkPipeline* pipeline) {
+    VkShaderModule vertShaderModule = createShaderModule(vertCode, vertSize);
+    VkShaderModule fragShaderModule = createShaderModule(fragCode, fragSize);
+    if (vertShaderModule == VK_NULL_HANDLE ||
+        fragShaderModule == VK_NULL_HANDLE) {
+        vkDestroyShaderModule(device, vertShaderModule, NULL);
+        vkDestroyShaderModule(device, fragShaderModule, NULL);
         return -1;
     }
 
-    VkShaderModule vertShaderModule =
-        createShaderModule(vertShaderCode, vertShaderSize);
-    VkShaderModule fragShaderModule =
-        createShaderModule(fragShaderCode, fragShaderSize);
+    // both stages see every constant, ids a stage doesn't declare are
+    // ignored
+    VkSpecializationMapEntry specializationEntries[PIPELINE_SPEC_CONSTANTS];
+    for (uint32_t i = 0; i < PIPELINE_SPEC_CONSTANTS; ++i) {
+        specializationEntries[i] = (VkSpecializationMapEntry){
+            .constantID = i,
+            .offset = i * sizeof(int32_t),
+            .size = sizeof(int32_t),
+        };
+    }
+    VkSpecializationInfo specializationInfo = {
+        .mapEntryCount = PIPELINE_SPEC_CONSTANTS,
+        .pMapEntries = specializationEntries,
+        .dataSize = sizeof(key->specialization),
+        .pData = key->specialization,
+    };
 
     VkPipelineShaderStageCreateInfo vertShaderStageInfo = {
         .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
         .stage = VK_SHADER_STAGE_VERTEX_BIT,
         .module = vertShaderModule,
         .pName = "main",
-        .pSpecializationInfo = NULL,
+        .pSpecializationInfo = &specializationInfo,
     };
     VkPipelineShaderStageCreateInfo fragShaderStageInfo = {
         .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
         .stage = VK_SHADER_STAGE_FRAGMENT_BIT,
         .module = fragShaderModule,
         .pName = "main",
-        .pSpecializationInfo = NULL,
+        .pSpecializationInfo = &specializationInfo,
     };
 
     VkPipelineShaderStageCreateInfo shaderStages[] = {vertShaderStageInfo,
@@ -897,10 +2453,14 @@ int createGraphicsPipeline() {
         .pDynamicStates = dynamicStates,
     };
 
-    VkVertexInputBindingDescription bindingDescriptions[1] = {
-        getBindingDescription()};
-    VkVertexInputAttributeDescription attributeDescriptions[2] = {
-        getPositionAttributeDescription(), getColorAttributeDescription()};
+    VkVertexInputBindingDescription bindingDescriptions[2] = {
+        getBindingDescription(key->packedVertices),
+        getInstanceBindingDescription()};
+    VkVertexInputAttributeDescription attributeDescriptions[5] = {
+        getPositionAttributeDescription(key->packedVertices),
+        getColorAttributeDescription(key->packedVertices),
+        getOffsetAttributeDescription(), getScaleAttributeDescription(),
+        getTintAttributeDescription()};
     VkPipelineVertexInputStateCreateInfo vertexInputInfo = {
         .sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO,
         .pVertexBindingDescriptions = bindingDescriptions,
@@ -913,7 +2473,7 @@ int createGraphicsPipeline() {
 
     VkPipelineInputAssemblyStateCreateInfo inputAssembly = {
         .sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO,
-        .topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST,
+        .topology = key->topology,
         .primitiveRestartEnable = VK_FALSE,
     };
 
@@ -941,9 +2501,9 @@ int createGraphicsPipeline() {
         .sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO,
         .depthClampEnable = VK_FALSE,
         .rasterizerDiscardEnable = VK_FALSE,
-        .polygonMode = VK_POLYGON_MODE_FILL,
+        .polygonMode = key->polygonMode,
         .lineWidth = 1.0f,
-        .cullMode = VK_CULL_MODE_BACK_BIT,
+        .cullMode = key->cullMode,
         .frontFace = VK_FRONT_FACE_CLOCKWISE,
         .depthBiasEnable = VK_FALSE,
         .depthBiasConstantFactor = 0.0f,
@@ -964,12 +2524,14 @@ int createGraphicsPipeline() {
     VkPipelineColorBlendAttachmentState colorBlendAttachment = {
         .colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT |
                           VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT,
-        .blendEnable = VK_FALSE,
+        .blendEnable = key->additiveBlend ? VK_TRUE : VK_FALSE,
         .srcColorBlendFactor = VK_BLEND_FACTOR_ONE,
-        .dstColorBlendFactor = VK_BLEND_FACTOR_ZERO,
+        .dstColorBlendFactor =
+            key->additiveBlend ? VK_BLEND_FACTOR_ONE : VK_BLEND_FACTOR_ZERO,
         .colorBlendOp = VK_BLEND_OP_ADD,
         .srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE,
-        .dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO,
+        .dstAlphaBlendFactor =
+            key->additiveBlend ? VK_BLEND_FACTOR_ONE : VK_BLEND_FACTOR_ZERO,
         .alphaBlendOp = VK_BLEND_OP_ADD,
     };
 
@@ -985,20 +2547,6 @@ int createGraphicsPipeline() {
         .blendConstants[3] = 0.0f, // Optional
     };
 
-    VkPipelineLayoutCreateInfo pipelineLayoutInfo = {
-        .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
-        .setLayoutCount = 0,
-        .pSetLayouts = NULL,
-        .pushConstantRangeCount = 0,
-        .pPushConstantRanges = NULL,
-    };
-
-    if (vkCreatePipelineLayout(device, &pipelineLayoutInfo, NULL,
-                               &pipelineLayout) != VK_SUCCESS) {
-        fprintf(stderr, "ERROR: failed to create pipeline layout\n");
-        return -1;
-    }
-
     VkGraphicsPipelineCreateInfo pipelineInfo = {
         .sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO,
         .stageCount = 2,
@@ -1011,33 +2559,532 @@ int createGraphicsPipeline() {
         .pDepthStencilState = NULL,
         .pColorBlendState = &colorBlending,
         .pDynamicState = &dynamicState,
-        .layout = pipelineLayout,
-        .renderPass = renderPass,
+        .layout = key->layout,
+        .renderPass = key->renderPass,
         .subpass = 0,
         .basePipelineHandle = VK_NULL_HANDLE,
         .basePipelineIndex = -1,
     };
 
-    if (vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &pipelineInfo,
-                                  NULL, &graphicsPipeline) != VK_SUCCESS) {
+    VkResult result = vkCreateGraphicsPipelines(device, pipelineCache, 1,
+                                                &pipelineInfo, NULL, pipeline);
+
+    vkDestroyShaderModule(device, vertShaderModule, NULL);
+    vkDestroyShaderModule(device, fragShaderModule, NULL);
+
+    if (result != VK_SUCCESS) {
         fprintf(stderr, "ERROR: failed to create graphics pipeline\n");
         return -1;
     }
+    return 0;
+}
+
+int createGraphicsPipeline() {
+    VkDescriptorSetLayoutBinding frameBinding = {
+        .binding = 0,
+        .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
+        .descriptorCount = 1,
+        .stageFlags = VK_SHADER_STAGE_VERTEX_BIT,
+    };
+    VkDescriptorSetLayoutCreateInfo setLayoutInfo = {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+        .bindingCount = 1,
+        .pBindings = &frameBinding,
+    };
+    if (vkCreateDescriptorSetLayout(device, &setLayoutInfo, NULL,
+                                    &frameSetLayout) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to create descriptor set layout\n");
+        return -1;
+    }
 
-    free(vertShaderCode);
-    free(fragShaderCode);
+    VkPushConstantRange pushConstantRange = {
+        .stageFlags = VK_SHADER_STAGE_VERTEX_BIT,
+        .offset = 0,
+        .size = sizeof(mat4),
+    };
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+        .setLayoutCount = 1,
+        .pSetLayouts = &frameSetLayout,
+        .pushConstantRangeCount = 1,
+        .pPushConstantRanges = &pushConstantRange,
+    };
 
-    vkDestroyShaderModule(device, vertShaderModule, NULL);
-    vkDestroyShaderModule(device, fragShaderModule, NULL);
+    if (vkCreatePipelineLayout(device, &pipelineLayoutInfo, NULL,
+                               &pipelineLayout) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to create pipeline layout\n");
+        return -1;
+    }
+
+    if (createPipelineRegistry() != 0 || usePipeline(viewMode) != 0) {
+        return -1;
+    }
+
+    // only a window can switch views, V should not stall on a compile
+    for (int view = 0; !headless && view < VIEW_MODE_COUNT; ++view) {
+        if (view != (int)viewMode &&
+            (view != VIEW_WIREFRAME || wireframeSupported)) {
+            PipelineKey key;
+            describePipeline((ViewMode)view, &key);
+            prefetchPipeline(&key);
+        }
+    }
+    return 0;
+}
+
+// FNV-1a
+static uint64_t hashBytes(const void* data, size_t size) {
+    const unsigned char* bytes = data;
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+    return hash;
+}
 
+// Builds every variant that is queued until quit is set.
+static void* pipelineRegistryMain(void* arg);
+
+int createPipelineRegistry() {
+    registry = (PipelineRegistry){
+        .vertCode = vertShaderCode,
+        .vertSize = sizeof(vertShaderCode),
+        .fragCode = fragShaderCode,
+        .fragSize = sizeof(fragShaderCode),
+    };
+    pthread_mutex_init(&registry.mutex, NULL);
+    pthread_cond_init(&registry.queued, NULL);
+    pthread_cond_init(&registry.built, NULL);
+
+    // without the thread queued variants are still built when first used
+    registry.threadStarted = pthread_create(&registry.thread, NULL,
+                                            pipelineRegistryMain, NULL) == 0;
+    if (!registry.threadStarted) {
+        fprintf(stderr, "WARNING: failed to start pipeline build thread\n");
+    }
+    return 0;
+}
+
+// The state for drawing in view with the current shaders. Reads the shaders
+// unlocked, only replacePipelineShaders() on the main thread changes them.
+void describePipeline(ViewMode view, PipelineKey* key) {
+    // zero any padding, keys are hashed and compared as bytes
+    memset(key, 0, sizeof(*key));
+    key->vertHash = hashBytes(registry.vertCode, registry.vertSize);
+    key->fragHash = hashBytes(registry.fragCode, registry.fragSize);
+    key->specialization[0] = (int32_t)view;
+    key->packedVertices = packedVertices;
+    key->topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+    key->polygonMode =
+        view == VIEW_WIREFRAME ? VK_POLYGON_MODE_LINE : VK_POLYGON_MODE_FILL;
+    // overdraw counts the back faces too
+    key->cullMode =
+        view == VIEW_OVERDRAW ? VK_CULL_MODE_NONE : VK_CULL_MODE_BACK_BIT;
+    key->additiveBlend = view == VIEW_OVERDRAW;
+    key->layout = pipelineLayout;
+    key->renderPass = renderPass;
+}
+
+static PipelineVariant* findVariant(const PipelineKey* key, uint64_t hash) {
+    for (uint32_t i = 0; i < registry.variantCount; ++i) {
+        PipelineVariant* variant = &registry.variants[i];
+        if (variant->hash == hash &&
+            memcmp(&variant->key, key, sizeof(*key)) == 0) {
+            return variant;
+        }
+    }
+    return NULL;
+}
+
+static PipelineVariant* addVariant(const PipelineKey* key, uint64_t hash) {
+    if (registry.variantCount == MAX_PIPELINE_VARIANTS) {
+        fprintf(stderr, "ERROR: too many pipeline variants\n");
+        return NULL;
+    }
+    PipelineVariant* variant = &registry.variants[registry.variantCount++];
+    *variant = (PipelineVariant){
+        .key = *key,
+        .hash = hash,
+        .state = VARIANT_QUEUED,
+    };
+    return variant;
+}
+
+// Called with the mutex held, which is dropped while compiling. Variants
+// never move and the shaders aren't replaced while one is building.
+static void buildVariant(PipelineVariant* variant) {
+    variant->state = VARIANT_BUILDING;
+    PipelineKey key = variant->key;
+    pthread_mutex_unlock(&registry.mutex);
+
+    VkPipeline pipeline;
+    int result =
+        buildGraphicsPipeline(&key, registry.vertCode, registry.vertSize,
+                              registry.fragCode, registry.fragSize, &pipeline);
+
+    pthread_mutex_lock(&registry.mutex);
+    variant->state = result == 0 ? VARIANT_READY : VARIANT_FAILED;
+    variant->pipeline = result == 0 ? pipeline : VK_NULL_HANDLE;
+    ++registry.builds;
+    pthread_cond_broadcast(&registry.built);
+}
+
+static void* pipelineRegistryMain(void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&registry.mutex);
+    while (!registry.quit) {
+        PipelineVariant* next = NULL;
+        for (uint32_t i = 0; i < registry.variantCount && next == NULL; ++i) {
+            if (registry.variants[i].state == VARIANT_QUEUED) {
+                next = &registry.variants[i];
+            }
+        }
+        if (next == NULL) {
+            pthread_cond_wait(&registry.queued, &registry.mutex);
+        } else {
+            buildVariant(next);
+        }
+    }
+    pthread_mutex_unlock(&registry.mutex);
+    return NULL;
+}
+
+// Returns the variant for key, building it first if nobody has yet.
+// VK_NULL_HANDLE if it doesn't build.
+VkPipeline getPipeline(const PipelineKey* key) {
+    uint64_t hash = hashBytes(key, sizeof(*key));
+    pthread_mutex_lock(&registry.mutex);
+    PipelineVariant* variant = findVariant(key, hash);
+    if (variant == NULL) {
+        variant = addVariant(key, hash);
+    }
+    if (variant != NULL && variant->state == VARIANT_QUEUED) {
+        buildVariant(variant);
+    }
+    while (variant != NULL && variant->state == VARIANT_BUILDING) {
+        pthread_cond_wait(&registry.built, &registry.mutex);
+    }
+    VkPipeline pipeline = variant != NULL ? variant->pipeline : VK_NULL_HANDLE;
+    pthread_mutex_unlock(&registry.mutex);
+    return pipeline;
+}
+
+// Queues key for the registry thread unless it is known already.
+void prefetchPipeline(const PipelineKey* key) {
+    uint64_t hash = hashBytes(key, sizeof(*key));
+    pthread_mutex_lock(&registry.mutex);
+    if (findVariant(key, hash) == NULL && addVariant(key, hash) != NULL) {
+        pthread_cond_signal(&registry.queued);
+    }
+    pthread_mutex_unlock(&registry.mutex);
+}
+
+// Binds the variant for view from the next recorded frame on.
+int usePipeline(ViewMode view) {
+    PipelineKey key;
+    describePipeline(view, &key);
+    VkPipeline pipeline = getPipeline(&key);
+    if (pipeline == VK_NULL_HANDLE) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&registry.mutex);
+    registry.current = key;
+    pthread_mutex_unlock(&registry.mutex);
+    graphicsPipeline = pipeline;
+    viewMode = view;
+    return 0;
+}
+
+// Called between frames after V was pressed. The registry keeps the
+// previous variant, so frames in flight can still use it.
+void cycleViewMode() {
+    viewModeRequested = false;
+    ViewMode view = viewMode;
+    do {
+        view = (ViewMode)((view + 1) % VIEW_MODE_COUNT);
+    } while (view == VIEW_WIREFRAME && !wireframeSupported);
+
+    if (usePipeline(view) != 0) {
+        fprintf(stderr, "WARNING: keeping the %s view\n",
+                viewModeNames[viewMode]);
+        return;
+    }
+    invalidateStaticCommands();
+    fprintf(stderr, "view: %s\n", viewModeNames[viewMode]);
+}
+
+// Main thread only. Every variant of the old shaders is retired once the
+// frames using it finish, and shaders->pipeline becomes the only variant.
+void replacePipelineShaders(ReloadedShaders* shaders) {
+    pthread_mutex_lock(&registry.mutex);
+    // nothing new may start building while the old shaders are waited out
+    for (uint32_t i = 0; i < registry.variantCount; ++i) {
+        if (registry.variants[i].state == VARIANT_QUEUED) {
+            registry.variants[i].state = VARIANT_FAILED;
+        }
+    }
+    for (uint32_t i = 0; i < registry.variantCount; ++i) {
+        while (registry.variants[i].state == VARIANT_BUILDING) {
+            pthread_cond_wait(&registry.built, &registry.mutex);
+        }
+        if (registry.variants[i].state == VARIANT_READY) {
+            deferDestroyPipeline(registry.variants[i].pipeline);
+        }
+    }
+    registry.variantCount = 0;
+
+    if (registry.ownsCode) {
+        free((void*)registry.vertCode);
+        free((void*)registry.fragCode);
+    }
+    registry.vertCode = shaders->vertCode;
+    registry.vertSize = shaders->vertSize;
+    registry.fragCode = shaders->fragCode;
+    registry.fragSize = shaders->fragSize;
+    registry.ownsCode = true;
+
+    PipelineVariant* variant = addVariant(
+        &shaders->key, hashBytes(&shaders->key, sizeof(shaders->key)));
+    variant->state = VARIANT_READY;
+    variant->pipeline = shaders->pipeline;
+    pthread_mutex_unlock(&registry.mutex);
+    *shaders = (ReloadedShaders){0};
+}
+
+void destroyPipelineRegistry() {
+    pthread_mutex_lock(&registry.mutex);
+    registry.quit = true;
+    pthread_cond_broadcast(&registry.queued);
+    pthread_mutex_unlock(&registry.mutex);
+    // a build in progress is let finish
+    if (registry.threadStarted) {
+        pthread_join(registry.thread, NULL);
+    }
+
+    for (uint32_t i = 0; i < registry.variantCount; ++i) {
+        if (registry.variants[i].state == VARIANT_READY) {
+            vkDestroyPipeline(device, registry.variants[i].pipeline, NULL);
+        }
+    }
+    if (registry.ownsCode) {
+        free((void*)registry.vertCode);
+        free((void*)registry.fragCode);
+    }
+    pthread_cond_destroy(&registry.built);
+    pthread_cond_destroy(&registry.queued);
+    pthread_mutex_destroy(&registry.mutex);
+    graphicsPipeline = VK_NULL_HANDLE;
+}
+
+// Runs glslc on path and returns the SPIR-V it writes to stdout, NULL if the
+// shader doesn't compile. glslc reports the errors itself.
+static uint32_t* compileShader(const char* path, size_t* codeSize) {
+    char command[256];
+    snprintf(command, sizeof(command), GLSLC " %s -o -", path);
+    FILE* out = popen(command, "r");
+    if (out == NULL) {
+        return NULL;
+    }
+
+    size_t capacity = 16 * 1024;
+    size_t size = 0;
+    char* code = malloc(capacity);
+    while (code != NULL) {
+        size += fread(code + size, 1, capacity - size, out);
+        if (size < capacity) {
+            break;
+        }
+        capacity *= 2;
+        char* grown = realloc(code, capacity);
+        if (grown == NULL) {
+            free(code);
+        }
+        code = grown;
+    }
+
+    if (pclose(out) != 0 || code == NULL || size == 0 ||
+        size % sizeof(uint32_t) != 0) {
+        free(code);
+        return NULL;
+    }
+    *codeSize = size;
+    return (uint32_t*)code;
+}
+
+static void reloadShaders() {
+    size_t vertSize = 0;
+    size_t fragSize = 0;
+    uint32_t* vertCode = compileShader(SHADER_DIR "/shader.vert", &vertSize);
+    uint32_t* fragCode = compileShader(SHADER_DIR "/shader.frag", &fragSize);
+
+    // the variant that is bound now, with the new shaders
+    pthread_mutex_lock(&registry.mutex);
+    PipelineKey key = registry.current;
+    pthread_mutex_unlock(&registry.mutex);
+    if (vertCode != NULL && fragCode != NULL) {
+        key.vertHash = hashBytes(vertCode, vertSize);
+        key.fragHash = hashBytes(fragCode, fragSize);
+    }
+
+    VkPipeline pipeline;
+    if (vertCode == NULL || fragCode == NULL ||
+        buildGraphicsPipeline(&key, vertCode, vertSize, fragCode, fragSize,
+                              &pipeline) != 0) {
+        fprintf(stderr, "WARNING: shader reload failed, keeping the current "
+                        "pipeline\n");
+        free(vertCode);
+        free(fragCode);
+        return;
+    }
+
+    ReloadedShaders shaders = {
+        .pipeline = pipeline,
+        .key = key,
+        .vertCode = vertCode,
+        .vertSize = vertSize,
+        .fragCode = fragCode,
+        .fragSize = fragSize,
+    };
+    pthread_mutex_lock(&reloader.mutex);
+    ReloadedShaders unused = reloader.pending;
+    reloader.pending = shaders;
+    pthread_mutex_unlock(&reloader.mutex);
+    // replaced before it was ever bound
+    if (unused.pipeline != VK_NULL_HANDLE) {
+        vkDestroyPipeline(device, unused.pipeline, NULL);
+        free(unused.vertCode);
+        free(unused.fragCode);
+    }
+    fprintf(stderr, "shaders reloaded\n");
+}
+
+// Drains the inotify queue, true if a graphics shader was written.
+static bool readShaderEvents() {
+    char buffer[4096]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t length = read(reloader.inotifyFd, buffer, sizeof(buffer));
+    bool changed = false;
+    for (ssize_t offset = 0; offset < length;) {
+        const struct inotify_event* event =
+            (const struct inotify_event*)(buffer + offset);
+        const char* dot = event->len > 0 ? strrchr(event->name, '.') : NULL;
+        if (dot != NULL &&
+            (strcmp(dot, ".vert") == 0 || strcmp(dot, ".frag") == 0)) {
+            changed = true;
+        }
+        offset += sizeof(struct inotify_event) + event->len;
+    }
+    return changed;
+}
+
+static void* shaderReloaderMain(void* arg) {
+    (void)arg;
+    struct pollfd fds[2] = {
+        {.fd = reloader.inotifyFd, .events = POLLIN},
+        {.fd = reloader.stopPipe[0], .events = POLLIN},
+    };
+    bool changed = false;
+
+    for (;;) {
+        int ready = poll(fds, 2, changed ? SHADER_RELOAD_SETTLE_MS : -1);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (fds[1].revents != 0) {
+            break;
+        }
+        if (ready > 0) {
+            changed |= readShaderEvents();
+        } else if (changed) {
+            changed = false;
+            reloadShaders();
+        }
+    }
+    return NULL;
+}
+
+int startShaderReloader() {
+    reloader.inotifyFd = inotify_init1(IN_CLOEXEC);
+    if (reloader.inotifyFd < 0) {
+        fprintf(stderr, "ERROR: failed to initialize inotify\n");
+        return -1;
+    }
+    // editors that save through a rename show up as IN_MOVED_TO
+    if (inotify_add_watch(reloader.inotifyFd, SHADER_DIR,
+                          IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        fprintf(stderr, "ERROR: couldn't watch %s\n", SHADER_DIR);
+        close(reloader.inotifyFd);
+        return -1;
+    }
+    if (pipe(reloader.stopPipe) != 0) {
+        close(reloader.inotifyFd);
+        return -1;
+    }
+
+    pthread_mutex_init(&reloader.mutex, NULL);
+    reloader.pending = (ReloadedShaders){0};
+    if (pthread_create(&reloader.thread, NULL, shaderReloaderMain, NULL) !=
+        0) {
+        fprintf(stderr, "ERROR: failed to start shader reload thread\n");
+        pthread_mutex_destroy(&reloader.mutex);
+        close(reloader.stopPipe[0]);
+        close(reloader.stopPipe[1]);
+        close(reloader.inotifyFd);
+        return -1;
+    }
     return 0;
 }
 
-VkShaderModule createShaderModule(const char* code, size_t codeSize) {
+// Called between frames. Frames already submitted keep the old pipelines,
+// which are retired once the graphics timeline passes them.
+void swapReloadedPipeline() {
+    pthread_mutex_lock(&reloader.mutex);
+    ReloadedShaders shaders = reloader.pending;
+    reloader.pending = (ReloadedShaders){0};
+    pthread_mutex_unlock(&reloader.mutex);
+
+    if (shaders.pipeline == VK_NULL_HANDLE) {
+        return;
+    }
+    replacePipelineShaders(&shaders);
+    // finds the reloaded variant unless the view changed meanwhile
+    if (usePipeline(viewMode) != 0) {
+        fprintf(stderr, "ERROR: no pipeline for the reloaded shaders\n");
+        exit(1);
+    }
+    invalidateStaticCommands();
+}
+
+void stopShaderReloader() {
+    // the thread may be in the middle of a rebuild, which is let finish
+    if (write(reloader.stopPipe[1], "", 1) == 1) {
+        pthread_join(reloader.thread, NULL);
+    } else {
+        // can't happen with a fresh pipe, leave the thread rather than hang
+        fprintf(stderr, "WARNING: failed to stop shader reload thread\n");
+        pthread_detach(reloader.thread);
+    }
+
+    if (reloader.pending.pipeline != VK_NULL_HANDLE) {
+        vkDestroyPipeline(device, reloader.pending.pipeline, NULL);
+        free(reloader.pending.vertCode);
+        free(reloader.pending.fragCode);
+    }
+    pthread_mutex_destroy(&reloader.mutex);
+    close(reloader.stopPipe[0]);
+    close(reloader.stopPipe[1]);
+    close(reloader.inotifyFd);
+}
+
+VkShaderModule createShaderModule(const uint32_t* code, size_t codeSize) {
     VkShaderModuleCreateInfo createInfo = {
         .sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
         .codeSize = codeSize,
-        .pCode = (uint32_t*)code,
+        .pCode = code,
     };
 
     VkShaderModule shaderModule;
@@ -1093,235 +3140,2336 @@ int createCommandPool() {
     return 0;
 }
 
-int createBuffer(VkDeviceSize size, VkBufferUsageFlags usage,
-                 VkMemoryPropertyFlags properties, VkBuffer* buffer,
-                 VkDeviceMemory* bufferMemory) {
-    VkBufferCreateInfo bufferInfo = {
-        .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
-        .size = size,
-        .usage = usage,
-        .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
-    };
-    if (vkCreateBuffer(device, &bufferInfo, NULL, buffer) != VK_SUCCESS) {
-        fprintf(stderr, "ERROR: Failed to create vertex buffer");
-        return -1;
-    }
-
-    VkMemoryRequirements memoryRequirements;
-    vkGetBufferMemoryRequirements(device, *buffer, &memoryRequirements);
+int initAllocator() {
+    vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memoryProperties);
+    memoryBlockCount = 0;
+    return 0;
+}
+
+static uint32_t log2Ceil(uint64_t x) {
+    return x <= 1 ? 0 : 64 - __builtin_clzll(x - 1);
+}
+
+static VkDeviceSize blockSizeForType(uint32_t memoryTypeIndex) {
+    uint32_t heapIndex =
+        memoryProperties.memoryTypes[memoryTypeIndex].heapIndex;
+    VkDeviceSize heapSize = memoryProperties.memoryHeaps[heapIndex].size;
+    VkDeviceSize size = ALLOCATOR_BLOCK_SIZE;
+    while (size > ALLOCATOR_MIN_BLOCK_SIZE && size > heapSize / 8) {
+        size /= 2;
+    }
+    return size;
+}
+
+static int createMemoryBlock(uint32_t memoryTypeIndex, AllocationKind kind,
+                             VkDeviceSize size, bool dedicated,
+                             uint32_t* blockIndex) {
+    uint32_t index = 0;
+    while (index < memoryBlockCount &&
+           memoryBlocks[index].memory != VK_NULL_HANDLE) {
+        ++index;
+    }
+    if (index == ALLOCATOR_MAX_BLOCKS) {
+        fprintf(stderr, "ERROR: out of memory block slots\n");
+        return -1;
+    }
+
+    MemoryBlock block = {
+        .size = size,
+        .memoryTypeIndex = memoryTypeIndex,
+        .kind = kind,
+        .dedicated = dedicated,
+    };
+
     VkMemoryAllocateInfo allocInfo = {
         .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-        .allocationSize = memoryRequirements.size,
-        .memoryTypeIndex =
-            findMemoryType(memoryRequirements.memoryTypeBits, properties),
+        .allocationSize = size,
+        .memoryTypeIndex = memoryTypeIndex,
+    };
+    if (vkAllocateMemory(device, &allocInfo, NULL, &block.memory) !=
+        VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to allocate %lu byte memory block\n",
+                size);
+        return -1;
+    }
+
+    // sub-allocations share the VkDeviceMemory, which may only be mapped
+    // once, so host visible blocks stay mapped for their whole lifetime
+    if (memoryProperties.memoryTypes[memoryTypeIndex].propertyFlags &
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+        if (vkMapMemory(device, block.memory, 0, size, 0, &block.mapped) !=
+            VK_SUCCESS) {
+            fprintf(stderr, "ERROR: failed to map memory block\n");
+            vkFreeMemory(device, block.memory, NULL);
+            return -1;
+        }
+    }
+
+    if (!dedicated) {
+        block.maxOrder = log2Ceil(size / ALLOCATOR_MIN_ALLOCATION);
+        size_t nodeCount = (2ull << block.maxOrder) - 1;
+        block.tree = malloc(nodeCount);
+        if (block.tree == NULL) {
+            fprintf(stderr, "ERROR: failed to allocate buddy tree\n");
+            vkFreeMemory(device, block.memory, NULL);
+            return -1;
+        }
+        // node n sits at depth floor(log2(n + 1)) and starts out entirely
+        // free
+        for (size_t node = 0; node < nodeCount; ++node) {
+            uint32_t depth = 63 - __builtin_clzll(node + 1);
+            block.tree[node] = (uint8_t)(block.maxOrder - depth + 1);
+        }
+    }
+
+    memoryBlocks[index] = block;
+    if (index == memoryBlockCount) {
+        ++memoryBlockCount;
+    }
+    *blockIndex = index;
+    return 0;
+}
+
+static void destroyMemoryBlock(uint32_t blockIndex) {
+    MemoryBlock* block = &memoryBlocks[blockIndex];
+    if (block->mapped != NULL) {
+        vkUnmapMemory(device, block->memory);
+    }
+    vkFreeMemory(device, block->memory, NULL);
+    free(block->tree);
+    *block = (MemoryBlock){.memory = VK_NULL_HANDLE};
+}
+
+static uint32_t nodeOrder(const MemoryBlock* block, uint32_t node) {
+    return block->maxOrder - (63 - __builtin_clzll((uint64_t)node + 1));
+}
+
+// Recomputes the ancestors of node, merging buddies that are both free.
+static void updateBuddyParents(MemoryBlock* block, uint32_t node) {
+    while (node > 0) {
+        node = (node - 1) / 2;
+        uint8_t left = block->tree[2 * node + 1];
+        uint8_t right = block->tree[2 * node + 2];
+        uint8_t childFree = (uint8_t)nodeOrder(block, 2 * node + 1) + 1;
+        if (left == childFree && right == childFree) {
+            block->tree[node] = childFree + 1;
+        } else {
+            block->tree[node] = left > right ? left : right;
+        }
+    }
+}
+
+// Returns the node of a free run of the given order, or -1.
+static int64_t buddyAlloc(MemoryBlock* block, uint32_t order) {
+    if (block->tree[0] < order + 1) {
+        return -1;
+    }
+
+    uint32_t node = 0;
+    for (uint32_t current = block->maxOrder; current > order; --current) {
+        uint32_t left = 2 * node + 1;
+        node = block->tree[left] >= order + 1 ? left : left + 1;
+    }
+
+    block->tree[node] = 0;
+    updateBuddyParents(block, node);
+    return node;
+}
+
+static VkDeviceSize buddyOffset(const MemoryBlock* block, uint32_t node) {
+    uint32_t order = nodeOrder(block, node);
+    uint64_t firstNodeAtOrder = (1ull << (block->maxOrder - order)) - 1;
+    return ((node - firstNodeAtOrder) << order) * ALLOCATOR_MIN_ALLOCATION;
+}
+
+// Buddies are aligned to their own size, so rounding the request up to at
+// least its alignment is enough to satisfy any alignment requirement.
+int allocateMemory(const VkMemoryRequirements* requirements,
+                   VkMemoryPropertyFlags properties, AllocationKind kind,
+                   MemoryAllocation* allocation) {
+    uint32_t memoryTypeIndex =
+        findMemoryType(requirements->memoryTypeBits, properties);
+    VkDeviceSize blockSize = blockSizeForType(memoryTypeIndex);
+
+    VkDeviceSize size = requirements->size;
+    if (size < requirements->alignment) {
+        size = requirements->alignment;
+    }
+    if (size < ALLOCATOR_MIN_ALLOCATION) {
+        size = ALLOCATOR_MIN_ALLOCATION;
+    }
+    uint32_t order = log2Ceil(size / ALLOCATOR_MIN_ALLOCATION +
+                              (size % ALLOCATOR_MIN_ALLOCATION != 0));
+
+    uint32_t blockIndex;
+    if ((ALLOCATOR_MIN_ALLOCATION << order) > blockSize) {
+        if (createMemoryBlock(memoryTypeIndex, kind, requirements->size, true,
+                              &blockIndex) != 0) {
+            return -1;
+        }
+        MemoryBlock* block = &memoryBlocks[blockIndex];
+        block->usedBytes = requirements->size;
+        block->requestedBytes = requirements->size;
+        block->allocationCount = 1;
+        *allocation = (MemoryAllocation){
+            .memory = block->memory,
+            .offset = 0,
+            .size = requirements->size,
+            .mapped = block->mapped,
+            .blockIndex = blockIndex,
+        };
+        return 0;
+    }
+
+    int64_t node = -1;
+    for (blockIndex = 0; blockIndex < memoryBlockCount; ++blockIndex) {
+        MemoryBlock* block = &memoryBlocks[blockIndex];
+        if (block->memory == VK_NULL_HANDLE || block->dedicated ||
+            block->memoryTypeIndex != memoryTypeIndex || block->kind != kind) {
+            continue;
+        }
+        node = buddyAlloc(block, order);
+        if (node >= 0) {
+            break;
+        }
+    }
+
+    if (node < 0) {
+        if (createMemoryBlock(memoryTypeIndex, kind, blockSize, false,
+                              &blockIndex) != 0) {
+            return -1;
+        }
+        node = buddyAlloc(&memoryBlocks[blockIndex], order);
+        assert(node >= 0);
+    }
+
+    MemoryBlock* block = &memoryBlocks[blockIndex];
+    VkDeviceSize offset = buddyOffset(block, node);
+    block->usedBytes += ALLOCATOR_MIN_ALLOCATION << order;
+    block->requestedBytes += requirements->size;
+    block->allocationCount++;
+
+    *allocation = (MemoryAllocation){
+        .memory = block->memory,
+        .offset = offset,
+        .size = requirements->size,
+        .mapped = block->mapped == NULL ? NULL : (char*)block->mapped + offset,
+        .blockIndex = blockIndex,
+        .node = (uint32_t)node,
+    };
+    return 0;
+}
+
+void freeMemory(MemoryAllocation* allocation) {
+    if (allocation->memory == VK_NULL_HANDLE) {
+        return;
+    }
+
+    MemoryBlock* block = &memoryBlocks[allocation->blockIndex];
+    assert(block->memory == allocation->memory);
+
+    if (block->dedicated) {
+        destroyMemoryBlock(allocation->blockIndex);
+    } else {
+        uint32_t order = nodeOrder(block, allocation->node);
+        block->tree[allocation->node] = (uint8_t)order + 1;
+        updateBuddyParents(block, allocation->node);
+        block->usedBytes -= ALLOCATOR_MIN_ALLOCATION << order;
+        block->requestedBytes -= allocation->size;
+        block->allocationCount--;
+    }
+
+    *allocation = (MemoryAllocation){.memory = VK_NULL_HANDLE};
+}
+
+AllocatorStats getAllocatorStats() {
+    AllocatorStats stats = {0};
+    VkDeviceSize freeBytes = 0;
+
+    for (uint32_t i = 0; i < memoryBlockCount; ++i) {
+        const MemoryBlock* block = &memoryBlocks[i];
+        if (block->memory == VK_NULL_HANDLE) {
+            continue;
+        }
+        stats.blockCount++;
+        stats.allocationCount += block->allocationCount;
+        stats.allocatedBytes += block->size;
+        stats.usedBytes += block->usedBytes;
+        stats.requestedBytes += block->requestedBytes;
+
+        if (!block->dedicated && block->tree[0] > 0) {
+            VkDeviceSize largest = ALLOCATOR_MIN_ALLOCATION
+                                   << (block->tree[0] - 1);
+            if (largest > stats.largestFreeBytes) {
+                stats.largestFreeBytes = largest;
+            }
+            freeBytes += block->size - block->usedBytes;
+        }
+    }
+
+    if (freeBytes > 0) {
+        stats.fragmentation =
+            1.0 - (double)stats.largestFreeBytes / (double)freeBytes;
+    }
+    return stats;
+}
+
+void destroyAllocator() {
+    for (uint32_t i = 0; i < memoryBlockCount; ++i) {
+        if (memoryBlocks[i].memory != VK_NULL_HANDLE) {
+            destroyMemoryBlock(i);
+        }
+    }
+    memoryBlockCount = 0;
+}
+
+int createBuffer(VkDeviceSize size, VkBufferUsageFlags usage,
+                 VkMemoryPropertyFlags properties, VkBuffer* buffer,
+                 MemoryAllocation* bufferMemory) {
+    VkBufferCreateInfo bufferInfo = {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+        .size = size,
+        .usage = usage,
+        .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+    };
+    if (vkCreateBuffer(device, &bufferInfo, NULL, buffer) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: Failed to create vertex buffer");
+        return -1;
+    }
+
+    VkMemoryRequirements memoryRequirements;
+    vkGetBufferMemoryRequirements(device, *buffer, &memoryRequirements);
+    if (allocateMemory(&memoryRequirements, properties, ALLOCATION_LINEAR,
+                       bufferMemory) != 0) {
+        fprintf(stderr, "ERROR: failed to allocate buffer memory\n");
+        vkDestroyBuffer(device, *buffer, NULL);
+        return -1;
+    }
+
+    vkBindBufferMemory(device, *buffer, bufferMemory->memory,
+                       bufferMemory->offset);
+    return 0;
+}
+
+void destroyBuffer(VkBuffer buffer, MemoryAllocation* bufferMemory) {
+    vkDestroyBuffer(device, buffer, NULL);
+    freeMemory(bufferMemory);
+}
+
+// memoryProperties is queried once by initAllocator()
+uint32_t findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties) {
+    for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; ++i) {
+        if ((typeFilter & (1 << i)) &&
+            (memoryProperties.memoryTypes[i].propertyFlags & properties) ==
+                properties) {
+            return i;
+        }
+    }
+
+    fprintf(stderr, "ERROR: Unable to find suitable memory type\n");
+    exit(1);
+}
+
+int createUploadManager() {
+    uploader = (UploadManager){
+        .openTicket = 1,
+        .completedTicket = 0,
+        .dedicatedQueue = transferQueueFamily != graphicsQueueFamily,
+    };
+
+    if (createBuffer(UPLOAD_RING_SIZE, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                         VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                     &uploader.stagingBuffer,
+                     &uploader.stagingMemory) != 0) {
+        fprintf(stderr, "ERROR: failed to create staging ring buffer\n");
+        return -1;
+    }
+
+    VkCommandPoolCreateInfo poolInfo = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+        .flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT |
+                 VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+        .queueFamilyIndex = transferQueueFamily,
+    };
+    if (vkCreateCommandPool(device, &poolInfo, NULL, &uploader.commandPool) !=
+        VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to create upload command pool\n");
+        return -1;
+    }
+    if (uploader.dedicatedQueue) {
+        poolInfo.queueFamilyIndex = graphicsQueueFamily;
+        if (vkCreateCommandPool(device, &poolInfo, NULL,
+                                &uploader.acquireCommandPool) != VK_SUCCESS) {
+            fprintf(stderr, "ERROR: failed to create upload command pool\n");
+            return -1;
+        }
+    }
+
+    VkCommandBufferAllocateInfo allocInfo = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+        .commandPool = uploader.commandPool,
+        .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+        .commandBufferCount = 1,
+    };
+    VkCommandBufferAllocateInfo acquireAllocInfo = allocInfo;
+    acquireAllocInfo.commandPool = uploader.acquireCommandPool;
+    for (size_t i = 0; i < UPLOAD_BATCH_COUNT; ++i) {
+        UploadBatch* batch = &uploader.batches[i];
+        if (vkAllocateCommandBuffers(device, &allocInfo,
+                                     &batch->commandBuffer) != VK_SUCCESS) {
+            fprintf(stderr, "ERROR: failed to create upload batch\n");
+            return -1;
+        }
+        if (uploader.dedicatedQueue &&
+            vkAllocateCommandBuffers(device, &acquireAllocInfo,
+                                     &batch->acquireCommandBuffer) !=
+                VK_SUCCESS) {
+            fprintf(stderr, "ERROR: failed to create upload batch\n");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Retires submitted batches in ticket order, stopping at the first one the
+// GPU has not finished yet.
+static void retireUploads() {
+    uint64_t completed = 0;
+    vkGetSemaphoreCounterValue(device, graphicsTimeline.semaphore, &completed);
+
+    while (uploader.completedTicket + 1 < uploader.openTicket) {
+        UploadTicket ticket = uploader.completedTicket + 1;
+        UploadBatch* batch = &uploader.batches[ticket % UPLOAD_BATCH_COUNT];
+        if (batch->graphicsValue > completed) {
+            break;
+        }
+        uploader.tail = batch->ringEnd;
+        uploader.completedTicket = ticket;
+    }
+}
+
+// Reserves size bytes of staging memory, flushing and waiting on older
+// batches until the ring has room.
+static int reserveStaging(VkDeviceSize size, VkDeviceSize* ringOffset) {
+    assert(size <= UPLOAD_RING_SIZE);
+
+    for (;;) {
+        VkDeviceSize head = (uploader.head + UPLOAD_RING_ALIGNMENT - 1) &
+                            ~(UPLOAD_RING_ALIGNMENT - 1);
+        // allocations never straddle the end of the ring
+        VkDeviceSize position = head % UPLOAD_RING_SIZE;
+        if (position + size > UPLOAD_RING_SIZE) {
+            head += UPLOAD_RING_SIZE - position;
+            position = 0;
+        }
+        if (head + size - uploader.tail <= UPLOAD_RING_SIZE) {
+            uploader.head = head + size;
+            *ringOffset = position;
+            return 0;
+        }
+
+        // the open batch may be what is holding the space
+        if (uploader.completedTicket + 1 == uploader.openTicket) {
+            if (uploadFlush() != 0) {
+                return -1;
+            }
+        }
+        if (uploadWait(uploader.completedTicket + 1) != 0) {
+            return -1;
+        }
+    }
+}
+
+// Reserves size bytes of the staging ring, at most UPLOAD_CHUNK_SIZE, and
+// queues their copy to dstBuffer. The caller writes the data to *data before
+// the next upload call, so data produced on the fly needs no extra copy.
+int uploadReserve(VkBuffer dstBuffer, VkDeviceSize dstOffset,
+                  VkDeviceSize size, void** data, UploadTicket* ticket) {
+    assert(size <= UPLOAD_CHUNK_SIZE);
+    if (uploader.copyCount == UPLOAD_MAX_COPIES && uploadFlush() != 0) {
+        return -1;
+    }
+
+    VkDeviceSize ringOffset;
+    if (reserveStaging(size, &ringOffset) != 0) {
+        return -1;
+    }
+    uploader.copies[uploader.copyCount++] = (UploadCopy){
+        .dstBuffer = dstBuffer,
+        .region =
+            {
+                .srcOffset = ringOffset,
+                .dstOffset = dstOffset,
+                .size = size,
+            },
+    };
+    *data = (char*)uploader.stagingMemory.mapped + ringOffset;
+
+    if (ticket != NULL) {
+        *ticket = uploader.openTicket;
+    }
+    return 0;
+}
+
+// Copies data into the staging ring and queues a copy to dstBuffer. Nothing
+// is submitted until the batch fills up or uploadFlush() is called. Large
+// uploads are split into chunks so they can stream through the ring.
+int uploadToBuffer(VkBuffer dstBuffer, VkDeviceSize dstOffset,
+                   const void* data, VkDeviceSize size, UploadTicket* ticket) {
+    VkDeviceSize done = 0;
+    while (done < size) {
+        VkDeviceSize chunk = size - done;
+        if (chunk > UPLOAD_CHUNK_SIZE) {
+            chunk = UPLOAD_CHUNK_SIZE;
+        }
+        void* staging;
+        if (uploadReserve(dstBuffer, dstOffset + done, chunk, &staging,
+                          NULL) != 0) {
+            return -1;
+        }
+        memcpy(staging, (const char*)data + done, (size_t)chunk);
+        done += chunk;
+    }
+
+    if (ticket != NULL) {
+        *ticket = uploader.openTicket;
+    }
+    return 0;
+}
+
+static int compare_upload_copy(const void* a, const void* b) {
+    uintptr_t x = (uintptr_t)((const UploadCopy*)a)->dstBuffer;
+    uintptr_t y = (uintptr_t)((const UploadCopy*)b)->dstBuffer;
+    return (x > y) - (x < y);
+}
+
+// Submits the open batch, if it has any copies. Copies to the same buffer
+// are merged into one vkCmdCopyBuffer. The batch ends in a barrier on the
+// graphics queue (the ownership acquire, with a dedicated transfer queue)
+// that makes the data visible to any later graphics submission, so draws
+// need not wait on the ticket from the CPU.
+int uploadFlush() {
+    if (uploader.copyCount == 0) {
+        return 0;
+    }
+
+    UploadTicket ticket = uploader.openTicket;
+    UploadBatch* batch = &uploader.batches[ticket % UPLOAD_BATCH_COUNT];
+
+    // the slot's previous batch must be done before its command buffers
+    // can be reused
+    if (ticket > UPLOAD_BATCH_COUNT &&
+        uploadWait(ticket - UPLOAD_BATCH_COUNT) != 0) {
+        return -1;
+    }
+    vkResetCommandBuffer(batch->commandBuffer, 0);
+
+    VkCommandBufferBeginInfo beginInfo = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+        .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+    };
+    if (vkBeginCommandBuffer(batch->commandBuffer, &beginInfo) !=
+        VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to begin upload command buffer\n");
+        return -1;
+    }
+
+    qsort(uploader.copies, uploader.copyCount, sizeof(uploader.copies[0]),
+          compare_upload_copy);
+    VkBufferCopy regions[UPLOAD_MAX_COPIES];
+    // one ownership barrier per destination buffer, covering every range
+    // written to it in this batch
+    VkBufferMemoryBarrier releases[UPLOAD_MAX_COPIES];
+    VkBufferMemoryBarrier acquires[UPLOAD_MAX_COPIES];
+    uint32_t barrierCount = 0;
+    for (uint32_t first = 0; first < uploader.copyCount;) {
+        VkBuffer dstBuffer = uploader.copies[first].dstBuffer;
+        VkDeviceSize begin = UINT64_MAX;
+        VkDeviceSize end = 0;
+        uint32_t count = 0;
+        while (first + count < uploader.copyCount &&
+               uploader.copies[first + count].dstBuffer == dstBuffer) {
+            VkBufferCopy region = uploader.copies[first + count].region;
+            regions[count] = region;
+            if (region.dstOffset < begin) {
+                begin = region.dstOffset;
+            }
+            if (region.dstOffset + region.size > end) {
+                end = region.dstOffset + region.size;
+            }
+            ++count;
+        }
+        vkCmdCopyBuffer(batch->commandBuffer, uploader.stagingBuffer,
+                        dstBuffer, count, regions);
+        first += count;
+
+        // Only the written range changes hands. The destination ranges are
+        // freshly overwritten, so the graphics queue never has to release
+        // them back to the transfer queue first.
+        releases[barrierCount] = (VkBufferMemoryBarrier){
+            .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+            .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+            .dstAccessMask = 0,
+            .srcQueueFamilyIndex = transferQueueFamily,
+            .dstQueueFamilyIndex = graphicsQueueFamily,
+            .buffer = dstBuffer,
+            .offset = begin,
+            .size = end - begin,
+        };
+        acquires[barrierCount] = releases[barrierCount];
+        acquires[barrierCount].srcAccessMask = 0;
+        acquires[barrierCount].dstAccessMask = UPLOAD_DST_ACCESS;
+        ++barrierCount;
+    }
+
+    if (uploader.dedicatedQueue) {
+        vkCmdPipelineBarrier(batch->commandBuffer,
+                             VK_PIPELINE_STAGE_TRANSFER_BIT,
+                             VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, NULL,
+                             barrierCount, releases, 0, NULL);
+    } else {
+        VkMemoryBarrier barrier = {
+            .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+            .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+            .dstAccessMask = UPLOAD_DST_ACCESS,
+        };
+        vkCmdPipelineBarrier(batch->commandBuffer,
+                             VK_PIPELINE_STAGE_TRANSFER_BIT, UPLOAD_DST_STAGES,
+                             0, 1, &barrier, 0, NULL, 0, NULL);
+    }
+
+    if (vkEndCommandBuffer(batch->commandBuffer) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to record upload command buffer\n");
+        return -1;
+    }
+
+    // without a dedicated queue transferQueue is the graphics queue, and
+    // this is the batch's only submit
+    Timeline* copyTimeline =
+        uploader.dedicatedQueue ? &transferTimeline : &graphicsTimeline;
+    uint64_t copyValue = copyTimeline->lastSubmitted + 1;
+    VkTimelineSemaphoreSubmitInfo copyTimelineInfo = {
+        .sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
+        .signalSemaphoreValueCount = 1,
+        .pSignalSemaphoreValues = &copyValue,
+    };
+    VkSubmitInfo submitInfo = {
+        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+        .pNext = &copyTimelineInfo,
+        .commandBufferCount = 1,
+        .pCommandBuffers = &batch->commandBuffer,
+        .signalSemaphoreCount = 1,
+        .pSignalSemaphores = &copyTimeline->semaphore,
     };
-    if (vkAllocateMemory(device, &allocInfo, NULL, bufferMemory) !=
+    if (vkQueueSubmit(transferQueue, 1, &submitInfo, VK_NULL_HANDLE) !=
         VK_SUCCESS) {
-        fprintf(stderr, "ERROR: failed to allcate vertexBufferMemory\n");
+        fprintf(stderr, "ERROR: failed to submit upload batch\n");
         return -1;
     }
+    copyTimeline->lastSubmitted = copyValue;
+
+    if (uploader.dedicatedQueue) {
+        vkResetCommandBuffer(batch->acquireCommandBuffer, 0);
+        if (vkBeginCommandBuffer(batch->acquireCommandBuffer, &beginInfo) !=
+            VK_SUCCESS) {
+            fprintf(stderr,
+                    "ERROR: failed to begin upload command buffer\n");
+            return -1;
+        }
+        vkCmdPipelineBarrier(batch->acquireCommandBuffer, UPLOAD_DST_STAGES,
+                             UPLOAD_DST_STAGES, 0, 0, NULL, barrierCount,
+                             acquires, 0, NULL);
+        if (vkEndCommandBuffer(batch->acquireCommandBuffer) != VK_SUCCESS) {
+            fprintf(stderr,
+                    "ERROR: failed to record upload command buffer\n");
+            return -1;
+        }
+
+        VkPipelineStageFlags waitStage = UPLOAD_DST_STAGES;
+        uint64_t acquireValue = graphicsTimeline.lastSubmitted + 1;
+        VkTimelineSemaphoreSubmitInfo acquireTimelineInfo = {
+            .sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
+            .waitSemaphoreValueCount = 1,
+            .pWaitSemaphoreValues = &copyValue,
+            .signalSemaphoreValueCount = 1,
+            .pSignalSemaphoreValues = &acquireValue,
+        };
+        VkSubmitInfo acquireInfo = {
+            .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+            .pNext = &acquireTimelineInfo,
+            .waitSemaphoreCount = 1,
+            .pWaitSemaphores = &transferTimeline.semaphore,
+            .pWaitDstStageMask = &waitStage,
+            .commandBufferCount = 1,
+            .pCommandBuffers = &batch->acquireCommandBuffer,
+            .signalSemaphoreCount = 1,
+            .pSignalSemaphores = &graphicsTimeline.semaphore,
+        };
+        if (vkQueueSubmit(graphicsQueue, 1, &acquireInfo, VK_NULL_HANDLE) !=
+            VK_SUCCESS) {
+            fprintf(stderr, "ERROR: failed to submit upload acquire\n");
+            return -1;
+        }
+        graphicsTimeline.lastSubmitted = acquireValue;
+    }
+
+    batch->ticket = ticket;
+    batch->graphicsValue = graphicsTimeline.lastSubmitted;
+    batch->ringEnd = uploader.head;
+    uploader.copyCount = 0;
+    uploader.openTicket++;
+    return 0;
+}
+
+// Returns true once the copies recorded under ticket have completed.
+bool uploadPoll(UploadTicket ticket) {
+    retireUploads();
+    return ticket <= uploader.completedTicket;
+}
+
+// Blocks until ticket has completed, submitting it first if still open.
+int uploadWait(UploadTicket ticket) {
+    if (ticket == uploader.openTicket) {
+        if (uploader.copyCount == 0) {
+            return 0; // nothing was recorded under it
+        }
+        if (uploadFlush() != 0) {
+            return -1;
+        }
+    }
+    assert(ticket < uploader.openTicket);
+
+    if (uploader.completedTicket >= ticket) {
+        return 0;
+    }
+
+    // batches finish in graphics timeline order, so this also covers every
+    // earlier ticket
+    UploadBatch* batch = &uploader.batches[ticket % UPLOAD_BATCH_COUNT];
+    assert(batch->ticket == ticket);
+    if (waitTimeline(&graphicsTimeline, batch->graphicsValue) != 0) {
+        fprintf(stderr, "ERROR: failed to wait for upload batch\n");
+        return -1;
+    }
+    retireUploads();
+    return 0;
+}
+
+void destroyUploadManager() {
+    if (uploader.openTicket > 1) {
+        uploadWait(uploader.openTicket - 1);
+    }
+    vkDestroyCommandPool(device, uploader.commandPool, NULL);
+    if (uploader.dedicatedQueue) {
+        vkDestroyCommandPool(device, uploader.acquireCommandPool, NULL);
+    }
+    destroyBuffer(uploader.stagingBuffer, &uploader.stagingMemory);
+}
+
+int createUniformRing() {
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+    uniformRing = (UniformRing){
+        .alignment = properties.limits.minUniformBufferOffsetAlignment,
+    };
+    sceneStartNs = nowNs();
+
+    // the allocator keeps host visible memory mapped
+    if (createBuffer((framesInFlight + 1) * UNIFORM_RING_SLICE_SIZE,
+                     VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                         VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                     &uniformRing.buffer, &uniformRing.memory) != 0) {
+        return -1;
+    }
+
+    // fixed for good, the recorded commands point at it
+    if (staticCommands) {
+        uniformRing.slice = framesInFlight;
+        return updateFrameData();
+    }
+    return 0;
+}
+
+// Returns size bytes of the current frame's slice, NULL once it is full.
+// dynamicOffset is where they start in the buffer.
+void* uniformAlloc(VkDeviceSize size, uint32_t* dynamicOffset) {
+    VkDeviceSize mask = uniformRing.alignment - 1;
+    VkDeviceSize offset = (uniformRing.head + mask) & ~mask;
+    if (offset + size > UNIFORM_RING_SLICE_SIZE) {
+        return NULL;
+    }
+    uniformRing.head = offset + size;
+
+    offset += (VkDeviceSize)uniformRing.slice * UNIFORM_RING_SLICE_SIZE;
+    *dynamicOffset = (uint32_t)offset;
+    return (char*)uniformRing.memory.mapped + offset;
+}
+
+// Called once the current frame slot was waited on, before its commands
+// are recorded. With --static-cmds only createUniformRing() calls it.
+int updateFrameData() {
+    if (!staticCommands) {
+        uniformRing.slice = currentFrame;
+    }
+    uniformRing.head = 0;
+
+    float time = animate ? (float)((nowNs() - sceneStartNs) / 1e9) : 0.0f;
+    FrameUniforms* uniforms =
+        uniformAlloc(sizeof(FrameUniforms), &frameData.uniformOffset);
+    if (uniforms == NULL) {
+        fprintf(stderr, "ERROR: uniform ring slice is full\n");
+        return -1;
+    }
+    float pulse = 0.75f + 0.25f * sinf(2.0f * time);
+    *uniforms = (FrameUniforms){
+        .tint = {pulse, pulse, pulse, 1.0f},
+        .time = time,
+    };
+
+    // the scene turns around the center of the view, the projection keeps
+    // the clip space mapping vertices had before the transform existed
+    mat4 projection;
+    mat4 view;
+    glm_ortho(-1.0f, 1.0f, -1.0f, 1.0f, -1.0f, 1.0f, projection);
+    glm_mat4_identity(view);
+    glm_rotate_z(view, 0.5f * time, view);
+    glm_mat4_mul(projection, view, frameData.mvp);
+    return 0;
+}
+
+int createFrameDescriptors() {
+    VkDescriptorPoolSize poolSize = {
+        .type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
+        .descriptorCount = 1,
+    };
+    VkDescriptorPoolCreateInfo poolInfo = {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+        .maxSets = 1,
+        .poolSizeCount = 1,
+        .pPoolSizes = &poolSize,
+    };
+    if (vkCreateDescriptorPool(device, &poolInfo, NULL,
+                               &frameDescriptorPool) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to create descriptor pool\n");
+        return -1;
+    }
+
+    VkDescriptorSetAllocateInfo allocInfo = {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+        .descriptorPool = frameDescriptorPool,
+        .descriptorSetCount = 1,
+        .pSetLayouts = &frameSetLayout,
+    };
+    if (vkAllocateDescriptorSets(device, &allocInfo, &frameDescriptorSet) !=
+        VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to allocate descriptor set\n");
+        return -1;
+    }
+
+    // the offset into the ring is given when binding
+    VkDescriptorBufferInfo bufferInfo = {
+        .buffer = uniformRing.buffer,
+        .offset = 0,
+        .range = sizeof(FrameUniforms),
+    };
+    VkWriteDescriptorSet write = {
+        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+        .dstSet = frameDescriptorSet,
+        .dstBinding = 0,
+        .descriptorCount = 1,
+        .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
+        .pBufferInfo = &bufferInfo,
+    };
+    vkUpdateDescriptorSets(device, 1, &write, 0, NULL);
+    return 0;
+}
+
+void destroyUniformRing() {
+    vkDestroyDescriptorPool(device, frameDescriptorPool, NULL);
+    destroyBuffer(uniformRing.buffer, &uniformRing.memory);
+}
+
+// Matches the SSE path: NaN clamps to min like _mm_max_ps(v, lo), and lrintf
+// rounds to nearest even like _mm_cvtps_epi32 in the default rounding mode.
+static int32_t quantize(float value, float min, float scale) {
+    value = !(value >= min) ? min : value > 1.0f ? 1.0f : value;
+    return (int32_t)lrintf(value * scale);
+}
+
+// q holds the five quantized components of one struct Vertex
+static void packVertex(const int32_t* q, struct PackedVertex* dst) {
+    dst->pos[0] = (int16_t)q[0];
+    dst->pos[1] = (int16_t)q[1];
+    dst->color[0] = (uint8_t)q[2];
+    dst->color[1] = (uint8_t)q[3];
+    dst->color[2] = (uint8_t)q[4];
+    dst->color[3] = UINT8_MAX;
+}
+
+// Converts vertices to the packed layout, positions to snorm16 and colors to
+// unorm8. A struct Vertex is five floats, so four of them fill exactly five
+// SSE registers and each register lane always holds the same component.
+void quantizeVertices(const struct Vertex* src, struct PackedVertex* dst,
+                      size_t count) {
+    size_t i = 0;
+#ifdef __SSE2__
+    __m128 lo[5], scale[5];
+    for (int r = 0; r < 5; ++r) {
+        float laneLo[4], laneScale[4];
+        for (int lane = 0; lane < 4; ++lane) {
+            bool isPosition = (r * 4 + lane) % 5 < 2;
+            laneLo[lane] = isPosition ? -1.0f : 0.0f;
+            laneScale[lane] = isPosition ? (float)INT16_MAX : (float)UINT8_MAX;
+        }
+        lo[r] = _mm_loadu_ps(laneLo);
+        scale[r] = _mm_loadu_ps(laneScale);
+    }
+    const __m128 one = _mm_set1_ps(1.0f);
+
+    const float* in = (const float*)src;
+    for (; i + 4 <= count; i += 4) {
+        int32_t q[20];
+        for (int r = 0; r < 5; ++r) {
+            __m128 v = _mm_loadu_ps(in + i * 5 + r * 4);
+            v = _mm_min_ps(_mm_max_ps(v, lo[r]), one);
+            _mm_storeu_si128((__m128i*)(q + r * 4),
+                             _mm_cvtps_epi32(_mm_mul_ps(v, scale[r])));
+        }
+        for (int k = 0; k < 4; ++k) {
+            packVertex(q + k * 5, &dst[i + k]);
+        }
+    }
+#endif
+    for (; i < count; ++i) {
+        int32_t q[5] = {
+            quantize(src[i].pos[0], -1.0f, INT16_MAX),
+            quantize(src[i].pos[1], -1.0f, INT16_MAX),
+            quantize(src[i].color[0], 0.0f, UINT8_MAX),
+            quantize(src[i].color[1], 0.0f, UINT8_MAX),
+            quantize(src[i].color[2], 0.0f, UINT8_MAX),
+        };
+        packVertex(q, &dst[i]);
+    }
+}
+
+// The shared vertex and index buffers are created at their final size first
+// and every mesh is then uploaded into its own range.
+int createVertexBuffer(uint64_t count) {
+    VkDeviceSize stride =
+        packedVertices ? sizeof(struct PackedVertex) : sizeof(struct Vertex);
+    return createBuffer(stride * count,
+                        VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+                            VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+                        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &vertexBuffer,
+                        &vertexBufferMemory);
+}
+
+int uploadVertices(const struct Vertex* data, uint64_t count,
+                   uint64_t firstVertex) {
+    if (!packedVertices) {
+        return uploadToBuffer(vertexBuffer, sizeof(struct Vertex) * firstVertex,
+                              data, sizeof(struct Vertex) * count, NULL);
+    }
+
+    // quantize straight into the staging ring, one chunk at a time
+    uint64_t chunkVertices = UPLOAD_CHUNK_SIZE / sizeof(struct PackedVertex);
+    for (uint64_t first = 0; first < count; first += chunkVertices) {
+        uint64_t chunk = count - first;
+        if (chunk > chunkVertices) {
+            chunk = chunkVertices;
+        }
+        void* staging;
+        if (uploadReserve(vertexBuffer,
+                          (firstVertex + first) * sizeof(struct PackedVertex),
+                          chunk * sizeof(struct PackedVertex), &staging,
+                          NULL) != 0) {
+            return -1;
+        }
+        quantizeVertices(data + first, staging, (size_t)chunk);
+    }
+    return 0;
+}
+
+int createIndexBuffer(VkIndexType type, uint64_t count) {
+    VkDeviceSize indexSize =
+        type == VK_INDEX_TYPE_UINT32 ? sizeof(uint32_t) : sizeof(uint16_t);
+    indexType = type;
+    return createBuffer(indexSize * count,
+                        VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+                            VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+                        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &indexBuffer,
+                        &indexBufferMemory);
+}
+
+// One loop per source and destination index size, so each is a plain copy
+// with a max-reduce the compiler can vectorize. They return the largest
+// index copied.
+static uint32_t copyIndices16To16(uint16_t* dst, const uint16_t* src,
+                                  uint64_t count) {
+    uint16_t largest = 0;
+    for (uint64_t i = 0; i < count; ++i) {
+        dst[i] = src[i];
+        largest = src[i] > largest ? src[i] : largest;
+    }
+    return largest;
+}
+
+static uint32_t copyIndices16To32(uint32_t* dst, const uint16_t* src,
+                                  uint64_t count) {
+    uint16_t largest = 0;
+    for (uint64_t i = 0; i < count; ++i) {
+        dst[i] = src[i];
+        largest = src[i] > largest ? src[i] : largest;
+    }
+    return largest;
+}
+
+static uint32_t copyIndices32To16(uint16_t* dst, const uint32_t* src,
+                                  uint64_t count) {
+    uint32_t largest = 0;
+    for (uint64_t i = 0; i < count; ++i) {
+        dst[i] = (uint16_t)src[i];
+        largest = src[i] > largest ? src[i] : largest;
+    }
+    return largest;
+}
+
+static uint32_t copyIndices32To32(uint32_t* dst, const uint32_t* src,
+                                  uint64_t count) {
+    uint32_t largest = 0;
+    for (uint64_t i = 0; i < count; ++i) {
+        dst[i] = src[i];
+        largest = src[i] > largest ? src[i] : largest;
+    }
+    return largest;
+}
+
+// Indices are widened or narrowed to the shared buffer's size on their way
+// into the staging ring, and each chunk is checked against the mesh's
+// vertexCount once it is copied.
+int uploadIndices(const void* data, uint32_t indexSize, uint64_t count,
+                  uint64_t vertexCount, uint64_t firstIndex) {
+    uint32_t dstSize = indexType == VK_INDEX_TYPE_UINT32 ? sizeof(uint32_t)
+                                                         : sizeof(uint16_t);
+    uint64_t chunkIndices = UPLOAD_CHUNK_SIZE / sizeof(uint32_t);
+    for (uint64_t first = 0; first < count; first += chunkIndices) {
+        uint64_t chunk = count - first;
+        if (chunk > chunkIndices) {
+            chunk = chunkIndices;
+        }
+        void* staging;
+        if (uploadReserve(indexBuffer, dstSize * (firstIndex + first),
+                          dstSize * chunk, &staging, NULL) != 0) {
+            return -1;
+        }
+
+        uint32_t largest;
+        if (indexSize == sizeof(uint16_t)) {
+            const uint16_t* src = (const uint16_t*)data + first;
+            largest = dstSize == sizeof(uint16_t)
+                          ? copyIndices16To16(staging, src, chunk)
+                          : copyIndices16To32(staging, src, chunk);
+        } else {
+            const uint32_t* src = (const uint32_t*)data + first;
+            largest = dstSize == sizeof(uint16_t)
+                          ? copyIndices32To16(staging, src, chunk)
+                          : copyIndices32To32(staging, src, chunk);
+        }
+        // the GPU would fetch outside the mesh, or another mesh
+        if (largest >= vertexCount) {
+            fprintf(stderr, "ERROR: mesh index out of range\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Returns false, with a message, if the blobs described by the header do
+// not fit the renderer or lie outside the file.
+static bool checkMeshHeader(const MeshHeader* header, uint64_t fileSize) {
+    if (header->magic != MESH_MAGIC || header->version != MESH_VERSION) {
+        fprintf(stderr, "ERROR: not a version %d mesh file\n", MESH_VERSION);
+        return false;
+    }
+    if (header->vertexStride != sizeof(struct Vertex) ||
+        (header->indexSize != sizeof(uint16_t) &&
+         header->indexSize != sizeof(uint32_t))) {
+        fprintf(stderr, "ERROR: unsupported mesh vertex or index layout\n");
+        return false;
+    }
+    uint64_t maxVertices = header->indexSize == sizeof(uint16_t)
+                               ? UINT16_MAX + 1ull
+                               : UINT32_MAX + 1ull;
+    if (header->vertexCount == 0 || header->vertexCount > maxVertices ||
+        header->indexCount == 0 || header->indexCount % 3 != 0 ||
+        header->indexCount > UINT32_MAX) {
+        fprintf(stderr, "ERROR: mesh has an invalid vertex or index count\n");
+        return false;
+    }
+
+    uint64_t vertexBytes = header->vertexCount * header->vertexStride;
+    uint64_t indexBytes = header->indexCount * header->indexSize;
+    if (header->vertexOffset % MESH_BLOB_ALIGNMENT != 0 ||
+        header->indexOffset % MESH_BLOB_ALIGNMENT != 0 ||
+        header->vertexOffset > fileSize ||
+        vertexBytes > fileSize - header->vertexOffset ||
+        header->indexOffset > fileSize ||
+        indexBytes > fileSize - header->indexOffset) {
+        fprintf(stderr, "ERROR: mesh file is truncated or corrupt\n");
+        return false;
+    }
+    return true;
+}
+
+// Replaces the mapped blobs with optimized heap copies, indices are 16 bit
+// again if the remaining vertices allow it.
+static int optimizeMeshSource(MeshSource* source) {
+    size_t vertexCount = (size_t)source->vertexCount;
+    size_t count = (size_t)source->indexCount;
+    MeshVertex* meshVertices = malloc(sizeof(MeshVertex) * vertexCount);
+    uint32_t* meshIndices = malloc(sizeof(uint32_t) * count);
+    source->ownedVertices = meshVertices;
+    source->ownedIndices = meshIndices;
+    if (meshVertices == NULL || meshIndices == NULL) {
+        fprintf(stderr, "ERROR: out of memory\n");
+        return -1;
+    }
+
+    memcpy(meshVertices, source->vertices, sizeof(MeshVertex) * vertexCount);
+    for (size_t i = 0; i < count; ++i) {
+        if (source->indexSize == sizeof(uint16_t)) {
+            meshIndices[i] = ((const uint16_t*)source->indices)[i];
+        } else {
+            meshIndices[i] = ((const uint32_t*)source->indices)[i];
+        }
+        // the optimizer indexes its own tables with these
+        if (meshIndices[i] >= vertexCount) {
+            fprintf(stderr, "ERROR: mesh index out of range\n");
+            return -1;
+        }
+    }
+
+    if (optimizeMesh(meshVertices, &vertexCount, meshIndices, count) != 0) {
+        fprintf(stderr, "ERROR: out of memory\n");
+        return -1;
+    }
+
+    source->vertices = meshVertices;
+    source->indices = meshIndices;
+    source->vertexCount = vertexCount;
+    source->indexSize = sizeof(uint32_t);
+    // vertices only ever merge, so a 32 bit mesh may now fit 16 bits
+    if (vertexCount <= UINT16_MAX + 1) {
+        uint16_t* narrow = (uint16_t*)meshIndices;
+        for (size_t i = 0; i < count; ++i) {
+            narrow[i] = (uint16_t)meshIndices[i];
+        }
+        source->indexSize = sizeof(uint16_t);
+    }
+
+    // the file isn't needed anymore
+    munmap(source->mapping, source->mappingSize);
+    source->mapping = NULL;
+    return 0;
+}
+
+// Maps a mesh written by tools/meshconv. Unless it is optimized on load the
+// blobs are later streamed from the mapping straight into the staging ring,
+// so the data is copied once on the CPU, the indices being range checked on
+// the way. Needs no device, so it runs while the device is still being
+// created.
+int openMeshSource(const char* path, MeshSource* source) {
+    *source = (MeshSource){0};
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: couldn't open file %s\n", path);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(MeshHeader)) {
+        fprintf(stderr, "ERROR: %s is not a mesh file\n", path);
+        close(fd);
+        return -1;
+    }
+    size_t fileSize = (size_t)st.st_size;
+
+    void* data = mmap(NULL, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "ERROR: failed to map %s\n", path);
+        return -1;
+    }
+    // each blob is read front to back exactly once
+    madvise(data, fileSize, MADV_SEQUENTIAL);
+    source->mapping = data;
+    source->mappingSize = fileSize;
+
+    const MeshHeader* header = data;
+    if (!checkMeshHeader(header, fileSize)) {
+        return -1;
+    }
+
+    source->vertices =
+        (const MeshVertex*)((const char*)data + header->vertexOffset);
+    source->indices = (const char*)data + header->indexOffset;
+    source->indexSize = header->indexSize;
+    source->vertexCount = header->vertexCount;
+    source->indexCount = header->indexCount;
+
+    if (optimizeMeshOnLoad) {
+        return optimizeMeshSource(source);
+    }
+    return 0;
+}
+
+void closeMeshSource(MeshSource* source) {
+    if (source->mapping != NULL) {
+        munmap(source->mapping, source->mappingSize);
+    }
+    free(source->ownedVertices);
+    free(source->ownedIndices);
+    *source = (MeshSource){0};
+}
+
+static void computeMeshBounds(const MeshSource* source, float bounds[4]) {
+    const MeshVertex* vertices = source->vertices;
+    bounds[0] = bounds[2] = vertices[0].position[0];
+    bounds[1] = bounds[3] = vertices[0].position[1];
+    for (uint64_t i = 1; i < source->vertexCount; ++i) {
+        for (int axis = 0; axis < 2; ++axis) {
+            float value = vertices[i].position[axis];
+            if (value < bounds[axis]) {
+                bounds[axis] = value;
+            }
+            if (value > bounds[axis + 2]) {
+                bounds[axis + 2] = value;
+            }
+        }
+    }
+}
+
+// Packs every mesh into the shared vertex and index buffers. Each mesh keeps
+// its own indices and is drawn with a vertexOffset, so 16 bit indices do as
+// long as no single mesh has more than 65536 vertices.
+int createMeshBuffers(const MeshSource* sources, uint32_t count) {
+    uint64_t totalVertices = 0;
+    uint64_t totalIndices = 0;
+    uint64_t largest = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        if (sources[i].vertexCount - 1 > maxIndexValue) {
+            fprintf(stderr, "ERROR: device can't index %llu vertices\n",
+                    (unsigned long long)sources[i].vertexCount);
+            return -1;
+        }
+        totalVertices += sources[i].vertexCount;
+        totalIndices += sources[i].indexCount;
+        if (sources[i].vertexCount > largest) {
+            largest = sources[i].vertexCount;
+        }
+    }
+    // firstIndex is 32 bit and vertexOffset signed 32 bit
+    if (totalIndices > UINT32_MAX || totalVertices > INT32_MAX) {
+        fprintf(stderr, "ERROR: meshes are too large to share one buffer\n");
+        return -1;
+    }
+
+    if (createVertexBuffer(totalVertices) != 0 ||
+        createIndexBuffer(largest <= UINT16_MAX + 1 ? VK_INDEX_TYPE_UINT16
+                                                    : VK_INDEX_TYPE_UINT32,
+                          totalIndices) != 0) {
+        return -1;
+    }
+
+    uint64_t firstVertex = 0;
+    uint64_t firstIndex = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        const MeshSource* source = &sources[i];
+        meshes[i] = (MeshRange){
+            .firstIndex = (uint32_t)firstIndex,
+            .indexCount = (uint32_t)source->indexCount,
+            .vertexOffset = (int32_t)firstVertex,
+        };
+        if (cullDraws) {
+            computeMeshBounds(source, meshes[i].bounds);
+        }
+        if (uploadVertices((const struct Vertex*)source->vertices,
+                           source->vertexCount, firstVertex) != 0 ||
+            uploadIndices(source->indices, source->indexSize,
+                          source->indexCount, source->vertexCount,
+                          firstIndex) != 0) {
+            return -1;
+        }
+        firstVertex += source->vertexCount;
+        firstIndex += source->indexCount;
+    }
+    meshCount = count;
+    return 0;
+}
+
+// Every --mesh file, or the built-in quad when there are none.
+int openMeshes() {
+    if (meshPathCount == 0) {
+        meshSources[0] = (MeshSource){
+            .vertices = (const MeshVertex*)vertices,
+            .indices = indices,
+            .indexSize = sizeof(indices[0]),
+            .vertexCount = sizeof(vertices) / sizeof(vertices[0]),
+            .indexCount = sizeof(indices) / sizeof(indices[0]),
+        };
+        meshSourceCount = 1;
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < meshPathCount; ++i) {
+        if (openMeshSource(meshPaths[i], &meshSources[i]) != 0) {
+            fprintf(stderr, "ERROR: failed to load mesh %s\n", meshPaths[i]);
+            return -1;
+        }
+    }
+    meshSourceCount = meshPathCount;
+    return 0;
+}
+
+void closeMeshes() {
+    for (uint32_t i = 0; i < meshPathCount; ++i) {
+        closeMeshSource(&meshSources[i]);
+    }
+    meshSourceCount = 0;
+}
+
+// Uploads what openMeshes() opened, the copies are queued by the time this
+// returns so the sources can go.
+int loadMeshes() {
+    int result = createMeshBuffers(meshSources, meshSourceCount);
+    closeMeshes();
+    return result;
+}
+
+// One command per draw of the draw list: draw i covers its share of the
+// instances and uses mesh i modulo meshCount. Direct draws read the host
+// copy, indirect draws the device buffer.
+int createDrawCommands() {
+    VkDeviceSize bufferSize = sizeof(VkDrawIndexedIndirectCommand) * drawCount;
+    drawCommands = malloc(bufferSize);
+    if (drawCommands == NULL) {
+        return -1;
+    }
+
+    for (uint32_t draw = 0; draw < drawCount; ++draw) {
+        uint32_t firstInstance =
+            (uint32_t)((uint64_t)draw * instanceCount / drawCount);
+        uint32_t endInstance =
+            (uint32_t)((uint64_t)(draw + 1) * instanceCount / drawCount);
+        const MeshRange* mesh = &meshes[draw % meshCount];
+        drawCommands[draw] = (VkDrawIndexedIndirectCommand){
+            .indexCount = mesh->indexCount,
+            .instanceCount = endInstance - firstInstance,
+            .firstIndex = mesh->firstIndex,
+            .vertexOffset = mesh->vertexOffset,
+            .firstInstance = firstInstance,
+        };
+    }
+
+    if (!indirectDraws) {
+        return 0;
+    }
+    // the culling pass reads the full list as a storage buffer
+    VkBufferUsageFlags usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+                               VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT;
+    if (cullDraws) {
+        usage |= VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+    }
+    if (createBuffer(bufferSize, usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                     &indirectBuffer, &indirectBufferMemory) != 0) {
+        return -1;
+    }
+    return uploadToBuffer(indirectBuffer, 0, drawCommands, bufferSize, NULL);
+}
+
+// Lays the instances out on a square grid covering the viewport, a single
+// instance keeps the original full size, untinted quad.
+int createInstanceBuffer() {
+    VkDeviceSize bufferSize = sizeof(struct Instance) * instanceCount;
+
+    struct Instance* instances = malloc(bufferSize);
+    if (instances == NULL) {
+        fprintf(stderr, "ERROR: failed to allocate instance data\n");
+        return -1;
+    }
+    instanceData = instances;
+
+    uint32_t columns = 1;
+    while ((uint64_t)columns * columns < instanceCount) {
+        ++columns;
+    }
+    // with a spread above 1 most of the grid lies outside the view
+    float extent = (float)sceneSpread;
+    float cell = 2.0f * extent / (float)columns;
+    float scale = instanceCount == 1 ? 1.0f : cell * 0.8f;
+    for (uint32_t i = 0; i < instanceCount; ++i) {
+        uint32_t x = i % columns;
+        uint32_t y = i / columns;
+        struct Instance* instance = &instances[i];
+        instance->offset[0] =
+            instanceCount == 1 ? 0.0f : -extent + cell * ((float)x + 0.5f);
+        instance->offset[1] =
+            instanceCount == 1 ? 0.0f : -extent + cell * ((float)y + 0.5f);
+        instance->scale[0] = scale;
+        instance->scale[1] = scale;
+        instance->color[0] = instanceCount == 1 ? 1.0f : (float)x / columns;
+        instance->color[1] = instanceCount == 1 ? 1.0f : (float)y / columns;
+        instance->color[2] = 1.0f;
+    }
+
+    int result = -1;
+    if (createBuffer(bufferSize,
+                     VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+                         VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &instanceBuffer,
+                     &instanceBufferMemory) == 0) {
+        result = uploadToBuffer(instanceBuffer, 0, instances, bufferSize, NULL);
+    }
+
+    // createCullBuffers() builds its bounds from the host copy
+    if (!cullDraws) {
+        free(instances);
+        instanceData = NULL;
+    }
+    return result;
+}
+
+// Bounds of every draw in clip space, the union of its instances' scaled
+// and offset mesh bounds. Consumes instanceData.
+static int uploadDrawBounds() {
+    VkDeviceSize bufferSize = sizeof(float) * 4 * drawCount;
+    float* bounds = malloc(bufferSize);
+    if (bounds == NULL) {
+        return -1;
+    }
+
+    for (uint32_t draw = 0; draw < drawCount; ++draw) {
+        const VkDrawIndexedIndirectCommand* command = &drawCommands[draw];
+        const float* mesh = meshes[draw % meshCount].bounds;
+        float* box = &bounds[draw * 4];
+        for (uint32_t i = 0; i < command->instanceCount; ++i) {
+            const struct Instance* instance =
+                &instanceData[command->firstInstance + i];
+            for (int axis = 0; axis < 2; ++axis) {
+                float lo = mesh[axis] * instance->scale[axis] +
+                           instance->offset[axis];
+                float hi = mesh[axis + 2] * instance->scale[axis] +
+                           instance->offset[axis];
+                if (i == 0 || lo < box[axis]) {
+                    box[axis] = lo;
+                }
+                if (i == 0 || hi > box[axis + 2]) {
+                    box[axis + 2] = hi;
+                }
+            }
+        }
+    }
+    free(instanceData);
+    instanceData = NULL;
+
+    int result = -1;
+    if (createBuffer(bufferSize,
+                     VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+                         VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &boundsBuffer,
+                     &boundsBufferMemory) == 0) {
+        result = uploadToBuffer(boundsBuffer, 0, bounds, bufferSize, NULL);
+    }
+    free(bounds);
+    return result;
+}
+
+// The buffers shaders/cull.comp reads and writes. Everything but the
+// visible list is static after startup.
+int createCullBuffers() {
+    if (uploadDrawBounds() != 0) {
+        return -1;
+    }
+
+    return createBuffer(VISIBLE_DRAWS_OFFSET +
+                            sizeof(VkDrawIndexedIndirectCommand) * drawCount,
+                        VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+                            VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                            VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+                        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &visibleBuffer,
+                        &visibleBufferMemory);
+}
+
+// The compute pipeline of shaders/cull.comp. Depends on nothing but the
+// device, so it is built next to the graphics pipeline.
+int createCullPipeline() {
+    // bounds, all draws, visible draws
+    VkDescriptorSetLayoutBinding bindings[3];
+    for (uint32_t i = 0; i < 3; ++i) {
+        bindings[i] = (VkDescriptorSetLayoutBinding){
+            .binding = i,
+            .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            .descriptorCount = 1,
+            .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+        };
+    }
+    VkDescriptorSetLayoutCreateInfo setLayoutInfo = {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+        .bindingCount = 3,
+        .pBindings = bindings,
+    };
+    if (vkCreateDescriptorSetLayout(device, &setLayoutInfo, NULL,
+                                    &cullSetLayout) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to create descriptor set layout\n");
+        return -1;
+    }
+
+    VkPushConstantRange pushConstantRange = {
+        .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+        .offset = 0,
+        .size = sizeof(CullConstants),
+    };
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+        .setLayoutCount = 1,
+        .pSetLayouts = &cullSetLayout,
+        .pushConstantRangeCount = 1,
+        .pPushConstantRanges = &pushConstantRange,
+    };
+    if (vkCreatePipelineLayout(device, &pipelineLayoutInfo, NULL,
+                               &cullPipelineLayout) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to create pipeline layout\n");
+        return -1;
+    }
+
+    VkShaderModule shaderModule =
+        createShaderModule(cullShaderCode, sizeof(cullShaderCode));
+    if (shaderModule == VK_NULL_HANDLE) {
+        return -1;
+    }
+
+    VkComputePipelineCreateInfo pipelineInfo = {
+        .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+        .stage =
+            {
+                .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+                .stage = VK_SHADER_STAGE_COMPUTE_BIT,
+                .module = shaderModule,
+                .pName = "main",
+            },
+        .layout = cullPipelineLayout,
+    };
+    VkResult result = vkCreateComputePipelines(
+        device, pipelineCache, 1, &pipelineInfo, NULL, &cullPipeline);
+    vkDestroyShaderModule(device, shaderModule, NULL);
+    if (result != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to create culling pipeline\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+int createCommandBuffers() {
+
+    VkCommandBufferAllocateInfo allocInfo = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+        .commandPool = commandPool,
+        .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+        .commandBufferCount = framesInFlight,
+    };
+
+    if (vkAllocateCommandBuffers(device, &allocInfo, commandBuffers) !=
+        VK_SUCCESS) {
+        return -1;
+    }
+
+    return 0;
+}
+
+// Records draws [firstDraw, endDraw) of the draw list along with the state
+// they need, so the same code serves primary and secondary command buffers.
+static void recordDraws(VkCommandBuffer commandBuffer, uint32_t firstDraw,
+                        uint32_t endDraw) {
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                      graphicsPipeline);
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                            pipelineLayout, 0, 1, &frameDescriptorSet, 1,
+                            &frameData.uniformOffset);
+    vkCmdPushConstants(commandBuffer, pipelineLayout,
+                       VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(mat4),
+                       frameData.mvp);
+
+    VkBuffer vertexBuffers[] = {vertexBuffer, instanceBuffer};
+    VkDeviceSize offsets[] = {0, 0};
+    vkCmdBindVertexBuffers(commandBuffer, 0, 2, vertexBuffers, offsets);
+    vkCmdBindIndexBuffer(commandBuffer, indexBuffer, 0, indexType);
+
+    VkViewport viewport = {
+        .x = 0.0f,
+        .y = 0.0f,
+        .width = (float)(swapChainExtent.width),
+        .height = (float)(swapChainExtent.height),
+        .minDepth = 0.0f,
+        .maxDepth = 1.0f,
+    };
+    vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+
+    VkRect2D scissor = {
+        .offset = {0, 0},
+        .extent = swapChainExtent,
+    };
+    vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+
+    // the visible list is only complete as a whole, and parseArgs keeps
+    // culled draws on the main thread
+    if (cullDraws) {
+        assert(firstDraw == 0 && endDraw == drawCount);
+        vkCmdDrawIndexedIndirectCount(
+            commandBuffer, visibleBuffer, VISIBLE_DRAWS_OFFSET, visibleBuffer,
+            VISIBLE_COUNT_OFFSET, drawCount,
+            sizeof(VkDrawIndexedIndirectCommand));
+        return;
+    }
+
+    if (indirectDraws) {
+        // one call per maxIndirectDraws commands, the whole list if the
+        // device has multiDrawIndirect
+        uint32_t stride = sizeof(VkDrawIndexedIndirectCommand);
+        for (uint32_t draw = firstDraw; draw < endDraw;) {
+            uint32_t batch = endDraw - draw;
+            if (batch > maxIndirectDraws) {
+                batch = maxIndirectDraws;
+            }
+            vkCmdDrawIndexedIndirect(commandBuffer, indirectBuffer,
+                                     (VkDeviceSize)draw * stride, batch,
+                                     stride);
+            draw += batch;
+        }
+        return;
+    }
+
+    for (uint32_t draw = firstDraw; draw < endDraw; ++draw) {
+        const VkDrawIndexedIndirectCommand* command = &drawCommands[draw];
+        vkCmdDrawIndexed(commandBuffer, command->indexCount,
+                         command->instanceCount, command->firstIndex,
+                         command->vertexOffset, command->firstInstance);
+    }
+}
+
+// Points the culling pass at its buffers, needs createCullPipeline()'s set
+// layout and createCullBuffers().
+int createCullDescriptors() {
+    VkDescriptorPoolSize poolSize = {
+        .type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        .descriptorCount = 3,
+    };
+    VkDescriptorPoolCreateInfo poolInfo = {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+        .maxSets = 1,
+        .poolSizeCount = 1,
+        .pPoolSizes = &poolSize,
+    };
+    if (vkCreateDescriptorPool(device, &poolInfo, NULL, &cullDescriptorPool) !=
+        VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to create descriptor pool\n");
+        return -1;
+    }
+
+    VkDescriptorSetAllocateInfo allocInfo = {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+        .descriptorPool = cullDescriptorPool,
+        .descriptorSetCount = 1,
+        .pSetLayouts = &cullSetLayout,
+    };
+    if (vkAllocateDescriptorSets(device, &allocInfo, &cullDescriptorSet) !=
+        VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to allocate descriptor set\n");
+        return -1;
+    }
+
+    VkDescriptorBufferInfo bufferInfos[3] = {
+        {.buffer = boundsBuffer, .offset = 0, .range = VK_WHOLE_SIZE},
+        {.buffer = indirectBuffer, .offset = 0, .range = VK_WHOLE_SIZE},
+        {.buffer = visibleBuffer, .offset = 0, .range = VK_WHOLE_SIZE},
+    };
+    VkWriteDescriptorSet writes[3];
+    for (uint32_t i = 0; i < 3; ++i) {
+        writes[i] = (VkWriteDescriptorSet){
+            .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+            .dstSet = cullDescriptorSet,
+            .dstBinding = i,
+            .descriptorCount = 1,
+            .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            .pBufferInfo = &bufferInfos[i],
+        };
+    }
+    vkUpdateDescriptorSets(device, 3, writes, 0, NULL);
+
+    return 0;
+}
+
+// Rebuilds the visible list ahead of the render pass: clear the count, then
+// let every draw that overlaps the view append itself.
+static void recordCulling(VkCommandBuffer commandBuffer) {
+    // an earlier frame may still be drawing from the visible list, and its
+    // cull writes must land before this frame's clear and appends (WAW)
+    VkBufferMemoryBarrier reused = {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT |
+                         VK_ACCESS_INDIRECT_COMMAND_READ_BIT,
+        .dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT |
+                         VK_ACCESS_SHADER_WRITE_BIT,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .buffer = visibleBuffer,
+        .offset = 0,
+        .size = VK_WHOLE_SIZE,
+    };
+    vkCmdPipelineBarrier(commandBuffer,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT |
+                             VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT |
+                             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         0, 0, NULL, 1, &reused, 0, NULL);
+    vkCmdFillBuffer(commandBuffer, visibleBuffer, VISIBLE_COUNT_OFFSET,
+                    sizeof(uint32_t), 0);
+
+    VkBufferMemoryBarrier cleared = {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+        .dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .buffer = visibleBuffer,
+        .offset = VISIBLE_COUNT_OFFSET,
+        .size = sizeof(uint32_t),
+    };
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, NULL, 1,
+                         &cleared, 0, NULL);
+
+    CullConstants constants = {
+        .view = {-1.0f, -1.0f, 1.0f, 1.0f},
+        .drawCount = drawCount,
+    };
+    glm_mat4_copy(frameData.mvp, constants.mvp);
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                      cullPipeline);
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                            cullPipelineLayout, 0, 1, &cullDescriptorSet, 0,
+                            NULL);
+    vkCmdPushConstants(commandBuffer, cullPipelineLayout,
+                       VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(constants),
+                       &constants);
+    vkCmdDispatch(commandBuffer,
+                  (drawCount + CULL_WORKGROUP_SIZE - 1) / CULL_WORKGROUP_SIZE,
+                  1, 1);
+
+    VkBufferMemoryBarrier culled = {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+        .dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .buffer = visibleBuffer,
+        .offset = 0,
+        .size = VK_WHOLE_SIZE,
+    };
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, 0, 0, NULL, 1,
+                         &culled, 0, NULL);
+}
+
+// timestampPool may be VK_NULL_HANDLE when timestamps are unsupported
+int recordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t imageIndex,
+                        VkQueryPool timestampPool) {
+
+    VkCommandBufferBeginInfo beginInfo = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+        .flags = 0,
+        .pInheritanceInfo = NULL,
+    };
+
+    if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to begin recording command buffer\n");
+        return -1;
+    }
+
+    if (timestampPool != VK_NULL_HANDLE) {
+        vkCmdResetQueryPool(commandBuffer, timestampPool, 0, TIMESTAMP_COUNT);
+        vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                            timestampPool, TIMESTAMP_FRAME_BEGIN);
+    }
+
+    if (cullDraws) {
+        recordCulling(commandBuffer);
+    }
+
+    VkClearValue clearColor = {{{0.0f, 0.0f, 0.0f, 1.0f}}};
+    VkRenderPassBeginInfo renderPassInfo = {
+        .sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
+        .renderPass = renderPass,
+        .framebuffer = swapChainFrameBuffers[imageIndex],
+        .renderArea.offset = {0, 0},
+        .renderArea.extent = swapChainExtent,
+        .clearValueCount = 1,
+        .pClearValues = &clearColor,
+    };
+
+    if (recordPool.workerCount > 0) {
+        // the draw timestamps are written by the first and last worker
+        vkCmdBeginRenderPass(commandBuffer, &renderPassInfo,
+                             VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+
+        if (recordInParallel(imageIndex, timestampPool) != 0) {
+            // close what was begun so the buffer isn't left recording
+            vkCmdEndRenderPass(commandBuffer);
+            vkEndCommandBuffer(commandBuffer);
+            return -1;
+        }
+
+        VkCommandBuffer secondaries[MAX_RECORD_THREADS];
+        for (uint32_t i = 0; i < recordPool.workerCount; ++i) {
+            secondaries[i] =
+                recordPool.workers[i].commandBuffers[recordPool.frame];
+        }
+        vkCmdExecuteCommands(commandBuffer, recordPool.workerCount,
+                             secondaries);
+    } else {
+        vkCmdBeginRenderPass(commandBuffer, &renderPassInfo,
+                             VK_SUBPASS_CONTENTS_INLINE);
+
+        if (timestampPool != VK_NULL_HANDLE) {
+            vkCmdWriteTimestamp(commandBuffer,
+                                VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                                timestampPool, TIMESTAMP_DRAW_BEGIN);
+        }
+
+        recordDraws(commandBuffer, 0, drawCount);
+
+        if (timestampPool != VK_NULL_HANDLE) {
+            vkCmdWriteTimestamp(commandBuffer,
+                                VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                                timestampPool, TIMESTAMP_DRAW_END);
+        }
+    }
+
+    vkCmdEndRenderPass(commandBuffer);
+
+    if (timestampPool != VK_NULL_HANDLE) {
+        vkCmdWriteTimestamp(commandBuffer,
+                            VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                            timestampPool, TIMESTAMP_FRAME_END);
+    }
+    if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to record command buffer\n");
+        // an invalid buffer goes back to the initial state
+        vkResetCommandBuffer(commandBuffer, 0);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Records one worker's slice of the draw list for the frame in recordPool.
+static int recordWorkerSlice(RecordWorker* worker) {
+    uint32_t frame = recordPool.frame;
+    uint32_t workerCount = recordPool.workerCount;
+    VkCommandBuffer commandBuffer = worker->commandBuffers[frame];
+
+    // the frame slot was waited on, nothing from this pool is in flight
+    vkResetCommandPool(device, worker->commandPools[frame], 0);
+
+    VkCommandBufferInheritanceInfo inheritanceInfo = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO,
+        .renderPass = renderPass,
+        .subpass = 0,
+        .framebuffer = swapChainFrameBuffers[recordPool.imageIndex],
+    };
+    VkCommandBufferBeginInfo beginInfo = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+        .flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT |
+                 VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+        .pInheritanceInfo = &inheritanceInfo,
+    };
+
+    if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to begin secondary command buffer\n");
+        return -1;
+    }
+
+    VkQueryPool timestampPool = recordPool.timestampPool;
+    if (timestampPool != VK_NULL_HANDLE && worker->index == 0) {
+        vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                            timestampPool, TIMESTAMP_DRAW_BEGIN);
+    }
+
+    uint32_t firstDraw =
+        (uint32_t)((uint64_t)worker->index * drawCount / workerCount);
+    uint32_t endDraw =
+        (uint32_t)((uint64_t)(worker->index + 1) * drawCount / workerCount);
+    recordDraws(commandBuffer, firstDraw, endDraw);
+
+    if (timestampPool != VK_NULL_HANDLE && worker->index == workerCount - 1) {
+        vkCmdWriteTimestamp(commandBuffer,
+                            VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                            timestampPool, TIMESTAMP_DRAW_END);
+    }
+
+    if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to record secondary command buffer\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void* recordWorkerMain(void* arg) {
+    RecordWorker* worker = arg;
+    uint64_t seenGeneration = 0;
+
+    pthread_mutex_lock(&recordPool.mutex);
+    for (;;) {
+        while (!recordPool.quit && recordPool.generation == seenGeneration) {
+            pthread_cond_wait(&recordPool.start, &recordPool.mutex);
+        }
+        if (recordPool.quit) {
+            break;
+        }
+        seenGeneration = recordPool.generation;
+        pthread_mutex_unlock(&recordPool.mutex);
+
+        int result = recordWorkerSlice(worker);
+
+        pthread_mutex_lock(&recordPool.mutex);
+        worker->result = result;
+        if (--recordPool.pending == 0) {
+            pthread_cond_signal(&recordPool.done);
+        }
+    }
+    pthread_mutex_unlock(&recordPool.mutex);
+
+    return NULL;
+}
+
+// Hands the current frame to every worker and blocks until all secondary
+// command buffers are recorded.
+int recordInParallel(uint32_t imageIndex, VkQueryPool timestampPool) {
+    pthread_mutex_lock(&recordPool.mutex);
+    recordPool.frame = currentFrame;
+    recordPool.imageIndex = imageIndex;
+    recordPool.timestampPool = timestampPool;
+    recordPool.pending = recordPool.workerCount;
+    ++recordPool.generation;
+    pthread_cond_broadcast(&recordPool.start);
+    while (recordPool.pending > 0) {
+        pthread_cond_wait(&recordPool.done, &recordPool.mutex);
+    }
+    pthread_mutex_unlock(&recordPool.mutex);
+
+    for (uint32_t i = 0; i < recordPool.workerCount; ++i) {
+        if (recordPool.workers[i].result != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int createRecordWorkers() {
+    // more workers than draws would only record empty command buffers
+    recordPool.workerCount =
+        recordThreads < drawCount ? recordThreads : drawCount;
+    if (recordPool.workerCount == 0) {
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < recordPool.workerCount; ++i) {
+        RecordWorker* worker = &recordPool.workers[i];
+        worker->index = i;
+
+        for (uint32_t frame = 0; frame < framesInFlight; ++frame) {
+            VkCommandPoolCreateInfo poolInfo = {
+                .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+                .flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT,
+                .queueFamilyIndex = graphicsQueueFamily,
+            };
+            if (vkCreateCommandPool(device, &poolInfo, NULL,
+                                    &worker->commandPools[frame]) !=
+                VK_SUCCESS) {
+                fprintf(stderr,
+                        "ERROR: failed to create worker command pool\n");
+                return -1;
+            }
+
+            VkCommandBufferAllocateInfo allocInfo = {
+                .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+                .commandPool = worker->commandPools[frame],
+                .level = VK_COMMAND_BUFFER_LEVEL_SECONDARY,
+                .commandBufferCount = 1,
+            };
+            if (vkAllocateCommandBuffers(device, &allocInfo,
+                                         &worker->commandBuffers[frame]) !=
+                VK_SUCCESS) {
+                fprintf(stderr,
+                        "ERROR: failed to allocate worker command buffer\n");
+                return -1;
+            }
+        }
+    }
+
+    pthread_mutex_init(&recordPool.mutex, NULL);
+    pthread_cond_init(&recordPool.start, NULL);
+    pthread_cond_init(&recordPool.done, NULL);
+    recordPool.generation = 0;
+    recordPool.quit = false;
+
+    for (uint32_t i = 0; i < recordPool.workerCount; ++i) {
+        if (pthread_create(&recordPool.workers[i].thread, NULL,
+                           recordWorkerMain, &recordPool.workers[i]) != 0) {
+            fprintf(stderr, "ERROR: failed to start recording thread\n");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void destroyRecordWorkers() {
+    if (recordPool.workerCount == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&recordPool.mutex);
+    recordPool.quit = true;
+    pthread_cond_broadcast(&recordPool.start);
+    pthread_mutex_unlock(&recordPool.mutex);
+
+    for (uint32_t i = 0; i < recordPool.workerCount; ++i) {
+        RecordWorker* worker = &recordPool.workers[i];
+        pthread_join(worker->thread, NULL);
+        for (uint32_t frame = 0; frame < framesInFlight; ++frame) {
+            vkDestroyCommandPool(device, worker->commandPools[frame], NULL);
+        }
+    }
+
+    pthread_cond_destroy(&recordPool.done);
+    pthread_cond_destroy(&recordPool.start);
+    pthread_mutex_destroy(&recordPool.mutex);
+    recordPool.workerCount = 0;
+}
+
+int createStaticCommandBuffers() {
+    invalidateStaticCommands();
+
+    if (!timestampsSupported) {
+        return 0;
+    }
+
+    VkCommandBufferAllocateInfo allocInfo = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+        .commandPool = commandPool,
+        .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+        .commandBufferCount = framesInFlight,
+    };
+    if (vkAllocateCommandBuffers(device, &allocInfo,
+                                 timestampBeginCommandBuffers) != VK_SUCCESS ||
+        vkAllocateCommandBuffers(device, &allocInfo,
+                                 timestampEndCommandBuffers) != VK_SUCCESS) {
+        return -1;
+    }
+
+    // the cached image commands carry no queries, so the draw timestamps
+    // bracket the whole render pass
+    VkCommandBufferBeginInfo beginInfo = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+    };
+    for (size_t i = 0; i < framesInFlight; ++i) {
+        VkCommandBuffer begin = timestampBeginCommandBuffers[i];
+        if (vkBeginCommandBuffer(begin, &beginInfo) != VK_SUCCESS) {
+            return -1;
+        }
+        vkCmdResetQueryPool(begin, timestampQueryPools[i], 0, TIMESTAMP_COUNT);
+        vkCmdWriteTimestamp(begin, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                            timestampQueryPools[i], TIMESTAMP_FRAME_BEGIN);
+        vkCmdWriteTimestamp(begin, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                            timestampQueryPools[i], TIMESTAMP_DRAW_BEGIN);
+        if (vkEndCommandBuffer(begin) != VK_SUCCESS) {
+            return -1;
+        }
+
+        VkCommandBuffer end = timestampEndCommandBuffers[i];
+        if (vkBeginCommandBuffer(end, &beginInfo) != VK_SUCCESS) {
+            return -1;
+        }
+        vkCmdWriteTimestamp(end, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                            timestampQueryPools[i], TIMESTAMP_DRAW_END);
+        vkCmdWriteTimestamp(end, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                            timestampQueryPools[i], TIMESTAMP_FRAME_END);
+        if (vkEndCommandBuffer(end) != VK_SUCCESS) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Marks every cached command buffer for re-recording. Call whenever
+// anything they reference changes. A buffer may still be pending, so it is
+// only reset after waiting for its image's timeline value.
+void invalidateStaticCommands() {
+    for (size_t i = 0; i < SWAPCHAIN_LENGTH; ++i) {
+        staticCommandsDirty[i] = true;
+    }
+}
+
+// The image's previous submission must have completed.
+int recordStaticCommandBuffer(uint32_t imageIndex) {
+    if (staticCommandBuffers[imageIndex] == VK_NULL_HANDLE) {
+        VkCommandBufferAllocateInfo allocInfo = {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+            .commandPool = commandPool,
+            .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+            .commandBufferCount = 1,
+        };
+        if (vkAllocateCommandBuffers(device, &allocInfo,
+                                     &staticCommandBuffers[imageIndex]) !=
+            VK_SUCCESS) {
+            fprintf(stderr, "ERROR: failed to allocate command buffer\n");
+            return -1;
+        }
+    } else {
+        vkResetCommandBuffer(staticCommandBuffers[imageIndex], 0);
+    }
 
-    vkBindBufferMemory(device, *buffer, *bufferMemory, 0);
+    if (recordCommandBuffer(staticCommandBuffers[imageIndex], imageIndex,
+                            VK_NULL_HANDLE) != 0) {
+        return -1;
+    }
+    staticCommandsDirty[imageIndex] = false;
     return 0;
 }
 
-uint32_t findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties) {
-    VkPhysicalDeviceMemoryProperties memoryProperties;
-    vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memoryProperties);
+static void destroyDeletion(Deletion* deletion) {
+    switch (deletion->kind) {
+    case DELETION_BUFFER:
+        destroyBuffer(deletion->buffer, &deletion->memory);
+        break;
+    case DELETION_MEMORY:
+        freeMemory(&deletion->memory);
+        break;
+    case DELETION_IMAGE_VIEW:
+        vkDestroyImageView(device, deletion->imageView, NULL);
+        break;
+    case DELETION_FRAMEBUFFER:
+        vkDestroyFramebuffer(device, deletion->frameBuffer, NULL);
+        break;
+    case DELETION_PIPELINE:
+        vkDestroyPipeline(device, deletion->pipeline, NULL);
+        break;
+    case DELETION_SWAPCHAIN:
+        vkDestroySwapchainKHR(device, deletion->swapChain, NULL);
+        break;
+    }
+}
 
-    for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; ++i) {
-        if ((typeFilter & (1 << i)) &&
-            (memoryProperties.memoryTypes[i].propertyFlags & properties) ==
-                properties) {
-            return i;
+static void pushDeletion(Deletion deletion) {
+    DeletionQueue* queue = &deletionQueue;
+    // anything already submitted may use the object
+    deletion.value = graphicsTimeline.lastSubmitted;
+
+    // reuse the space of destroyed entries before growing
+    if (queue->count == queue->capacity && queue->head > 0) {
+        memmove(queue->entries, queue->entries + queue->head,
+                sizeof(Deletion) * (queue->count - queue->head));
+        queue->count -= queue->head;
+        queue->head = 0;
+    }
+    if (queue->count == queue->capacity) {
+        size_t capacity = queue->capacity == 0 ? 64 : queue->capacity * 2;
+        Deletion* entries =
+            realloc(queue->entries, sizeof(Deletion) * capacity);
+        if (entries == NULL) {
+            // nowhere to keep it, destroy it the slow way
+            fprintf(stderr, "WARNING: failed to grow deletion queue, waiting "
+                            "for the GPU\n");
+            waitTimeline(&graphicsTimeline, deletion.value);
+            collectDeletions();
+            destroyDeletion(&deletion);
+            return;
         }
+        queue->entries = entries;
+        queue->capacity = capacity;
     }
 
-    fprintf(stderr, "ERROR: Unable to find suitable memory type\n");
-    exit(1);
+    queue->entries[queue->count++] = deletion;
 }
 
-int createVertexBuffer() {
-    VkDeviceSize bufferSize = sizeof(vertices);
-
-    VkBuffer stagingBuffer;
-    VkDeviceMemory stagingBufferMemory;
-    createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                     VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                 &stagingBuffer, &stagingBufferMemory);
-
-    void* data;
-    vkMapMemory(device, stagingBufferMemory, 0, bufferSize, 0, &data);
-    memcpy(data, vertices, (size_t)bufferSize);
-    vkUnmapMemory(device, stagingBufferMemory);
-
-    createBuffer(bufferSize,
-                 VK_BUFFER_USAGE_TRANSFER_DST_BIT |
-                     VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
-                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &vertexBuffer,
-                 &vertexBufferMemory);
-    copyBuffer(stagingBuffer, vertexBuffer, bufferSize);
-
-    vkDestroyBuffer(device, stagingBuffer, NULL);
-    vkFreeMemory(device, stagingBufferMemory, NULL);
+void deferDestroyBuffer(VkBuffer buffer, MemoryAllocation* bufferMemory) {
+    pushDeletion((Deletion){.kind = DELETION_BUFFER,
+                            .buffer = buffer,
+                            .memory = *bufferMemory});
+    *bufferMemory = (MemoryAllocation){0};
+}
 
-    return 0;
+void deferFreeMemory(MemoryAllocation* allocation) {
+    pushDeletion((Deletion){.kind = DELETION_MEMORY, .memory = *allocation});
+    *allocation = (MemoryAllocation){0};
 }
 
-void copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size) {
-    VkCommandBufferAllocateInfo allocInfo = {
-        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
-        .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
-        .commandPool = commandPool,
-        .commandBufferCount = 1,
-    };
-    VkCommandBuffer commandBuffer;
-    vkAllocateCommandBuffers(device, &allocInfo, &commandBuffer);
+void deferDestroyImageView(VkImageView imageView) {
+    pushDeletion(
+        (Deletion){.kind = DELETION_IMAGE_VIEW, .imageView = imageView});
+}
 
-    VkCommandBufferBeginInfo beginInfo = {
-        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
-        .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
-    };
-    vkBeginCommandBuffer(commandBuffer, &beginInfo);
+void deferDestroyFramebuffer(VkFramebuffer frameBuffer) {
+    pushDeletion(
+        (Deletion){.kind = DELETION_FRAMEBUFFER, .frameBuffer = frameBuffer});
+}
 
-    VkBufferCopy copyRegion = {
-        .size = size,
-        .srcOffset = 0,
-        .dstOffset = 0,
-    };
-    vkCmdCopyBuffer(commandBuffer, srcBuffer, dstBuffer, 1, &copyRegion);
+void deferDestroyPipeline(VkPipeline pipeline) {
+    pushDeletion((Deletion){.kind = DELETION_PIPELINE, .pipeline = pipeline});
+}
 
-    vkEndCommandBuffer(commandBuffer);
+void deferDestroySwapChain(VkSwapchainKHR swapChain) {
+    pushDeletion(
+        (Deletion){.kind = DELETION_SWAPCHAIN, .swapChain = swapChain});
+}
 
-    VkSubmitInfo submitInfo = {
-        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-        .commandBufferCount = 1,
-        .pCommandBuffers = &commandBuffer,
+// The graphics timeline only says the frames rendering to an old swapchain
+// are done, not that their presents are. Without
+// VK_EXT_swapchain_maintenance1 there are no present fences, so the old
+// swapchain is kept until framesInFlight more presents were queued after
+// it, and then until the GPU finished the frame of the last of them.
+void retireSwapChain(VkSwapchainKHR swapChain) {
+    // a window drag can retire one per frame, grow like the deletion queue
+    if (retiredSwapChainCount == retiredSwapChainCapacity) {
+        size_t capacity =
+            retiredSwapChainCapacity == 0 ? 8 : retiredSwapChainCapacity * 2;
+        RetiredSwapChain* entries = realloc(
+            retiredSwapChains, sizeof(RetiredSwapChain) * capacity);
+        if (entries == NULL) {
+            // only its frames are known to be done, better than leaking it
+            fprintf(stderr, "WARNING: failed to grow retired swapchain "
+                            "list, not waiting for its presents\n");
+            deferDestroySwapChain(swapChain);
+            return;
+        }
+        retiredSwapChains = entries;
+        retiredSwapChainCapacity = capacity;
+    }
+    retiredSwapChains[retiredSwapChainCount++] = (RetiredSwapChain){
+        .swapChain = swapChain,
+        .presentsLeft = framesInFlight,
     };
-    vkQueueSubmit(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE);
-    vkQueueWaitIdle(graphicsQueue);
-    vkFreeCommandBuffers(device, commandPool, 1, &commandBuffer);
 }
 
-int createIndexBuffer() {
-    VkDeviceSize bufferSize = sizeof(indices);
-
-    VkBuffer stagingBuffer;
-    VkDeviceMemory stagingBufferMemory;
-    createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                     VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                 &stagingBuffer, &stagingBufferMemory);
-    void* data;
-    vkMapMemory(device, stagingBufferMemory, 0, bufferSize, 0, &data);
-    memcpy(data, indices, (size_t)bufferSize);
-    vkUnmapMemory(device, stagingBufferMemory);
-
-    createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &indexBuffer, &indexBufferMemory);
-    copyBuffer(stagingBuffer, indexBuffer, bufferSize);
-
-    vkDestroyBuffer(device, stagingBuffer, NULL);
-    vkFreeMemory(device, stagingBufferMemory, NULL);
-    return 0;
+// Called after every present that was queued.
+void countPresent() {
+    size_t kept = 0;
+    for (size_t i = 0; i < retiredSwapChainCount; ++i) {
+        RetiredSwapChain retired = retiredSwapChains[i];
+        if (--retired.presentsLeft == 0) {
+            deferDestroySwapChain(retired.swapChain);
+        } else {
+            retiredSwapChains[kept++] = retired;
+        }
+    }
+    retiredSwapChainCount = kept;
 }
 
-int createCommandBuffers() {
-
-    VkCommandBufferAllocateInfo allocInfo = {
-        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
-        .commandPool = commandPool,
-        .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
-        .commandBufferCount = MAX_FRAMES_IN_FLIGHT,
-    };
+// The caller guarantees the device is idle.
+void destroyRetiredSwapChains() {
+    for (size_t i = 0; i < retiredSwapChainCount; ++i) {
+        vkDestroySwapchainKHR(device, retiredSwapChains[i].swapChain, NULL);
+    }
+    free(retiredSwapChains);
+    retiredSwapChains = NULL;
+    retiredSwapChainCount = 0;
+    retiredSwapChainCapacity = 0;
+}
 
-    if (vkAllocateCommandBuffers(device, &allocInfo, commandBuffers) !=
-        VK_SUCCESS) {
-        return -1;
+// Destroys every queued object the GPU has finished with, never blocks.
+void collectDeletions() {
+    DeletionQueue* queue = &deletionQueue;
+    if (queue->head == queue->count) {
+        return;
     }
 
-    return 0;
+    uint64_t completed = 0;
+    vkGetSemaphoreCounterValue(device, graphicsTimeline.semaphore, &completed);
+    while (queue->head < queue->count &&
+           queue->entries[queue->head].value <= completed) {
+        destroyDeletion(&queue->entries[queue->head++]);
+    }
+    if (queue->head == queue->count) {
+        queue->head = 0;
+        queue->count = 0;
+    }
 }
 
-int recordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t imageIndex) {
+// Destroys everything queued, the caller guarantees the GPU is done.
+void flushDeletions() {
+    DeletionQueue* queue = &deletionQueue;
+    while (queue->head < queue->count) {
+        destroyDeletion(&queue->entries[queue->head++]);
+    }
+    free(queue->entries);
+    *queue = (DeletionQueue){0};
+}
 
-    VkCommandBufferBeginInfo beginInfo = {
-        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
-        .flags = 0,
-        .pInheritanceInfo = NULL,
+int createTimeline(Timeline* timeline) {
+    VkSemaphoreTypeCreateInfo typeInfo = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO,
+        .semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE,
+        .initialValue = 0,
+    };
+    VkSemaphoreCreateInfo semaphoreInfo = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+        .pNext = &typeInfo,
     };
 
-    if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
-        fprintf(stderr, "ERROR: failed to begin recording command buffer\n");
+    timeline->lastSubmitted = 0;
+    if (vkCreateSemaphore(device, &semaphoreInfo, NULL,
+                          &timeline->semaphore) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to create timeline semaphore\n");
         return -1;
     }
+    return 0;
+}
 
-    VkClearValue clearColor = {{{0.0f, 0.0f, 0.0f, 1.0f}}};
-    VkRenderPassBeginInfo renderPassInfo = {
-        .sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
-        .renderPass = renderPass,
-        .framebuffer = swapChainFrameBuffers[imageIndex],
-        .renderArea.offset = {0, 0},
-        .renderArea.extent = swapChainExtent,
-        .clearValueCount = 1,
-        .pClearValues = &clearColor,
-    };
-
-    vkCmdBeginRenderPass(commandBuffer, &renderPassInfo,
-                         VK_SUBPASS_CONTENTS_INLINE);
-
-    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-                      graphicsPipeline);
-
-    VkBuffer vertexBuffers[] = {vertexBuffer};
-    VkDeviceSize offsets[] = {0};
-    vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffers, offsets);
-    vkCmdBindIndexBuffer(commandBuffer, indexBuffer, 0, VK_INDEX_TYPE_UINT16);
-
-    VkViewport viewport = {
-        .x = 0.0f,
-        .y = 0.0f,
-        .width = (float)(swapChainExtent.width),
-        .height = (float)(swapChainExtent.height),
-        .minDepth = 0.0f,
-        .maxDepth = 1.0f,
-    };
-    vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
-
-    VkRect2D scissor = {
-        .offset = {0, 0},
-        .extent = swapChainExtent,
+// Blocks until the timeline reaches value, value 0 returns immediately.
+int waitTimeline(const Timeline* timeline, uint64_t value) {
+    VkSemaphoreWaitInfo waitInfo = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+        .semaphoreCount = 1,
+        .pSemaphores = &timeline->semaphore,
+        .pValues = &value,
     };
-    vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
-
-    vkCmdDrawIndexed(commandBuffer, sizeof(indices)/sizeof(indices[0]), 1, 0, 0, 0);
-
-    vkCmdEndRenderPass(commandBuffer);
-    if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
-        fprintf(stderr, "ERROR: failed to record command buffer\n");
+    if (vkWaitSemaphores(device, &waitInfo, UINT64_MAX) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to wait for timeline semaphore\n");
         return -1;
     }
-
     return 0;
 }
 
+// Only the swapchain needs binary semaphores, frame completion is tracked
+// on the graphics timeline.
 int createSyncObjects() {
     VkSemaphoreCreateInfo semaphoreInfo = {
         .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
     };
 
-    VkFenceCreateInfo fenceInfo = {
-        .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
-        .flags = VK_FENCE_CREATE_SIGNALED_BIT,
-    };
-
-    for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
+    for (size_t i = 0; i < framesInFlight; ++i) {
+        frameTimelineValues[i] = 0;
         if (vkCreateSemaphore(device, &semaphoreInfo, NULL,
                               &imageAvailableSemaphores[i]) != VK_SUCCESS ||
             vkCreateSemaphore(device, &semaphoreInfo, NULL,
-                              &renderFinishedSemaphores[i]) != VK_SUCCESS ||
-            vkCreateFence(device, &fenceInfo, NULL, &inFlightFences[i]) !=
-                VK_SUCCESS) {
+                              &renderFinishedSemaphores[i]) != VK_SUCCESS) {
             fprintf(stderr,
                     "ERROR: failed to create synchronization objects for a "
                     "frame\n");
@@ -1332,10 +5480,117 @@ int createSyncObjects() {
     return 0;
 }
 
+int createTimestampQueryPools() {
+    QueueFamilyIndices indices = findQueueFamilies(physicalDevice);
+    assert(indices.graphicsFamily.is_present);
+
+    uint32_t queueFamilyCount = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount,
+                                             NULL);
+    VkQueueFamilyProperties queueFamilies[queueFamilyCount];
+    vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount,
+                                             queueFamilies);
+    uint32_t validBits =
+        queueFamilies[indices.graphicsFamily.value].timestampValidBits;
+
+    VkPhysicalDeviceProperties deviceProperties;
+    vkGetPhysicalDeviceProperties(physicalDevice, &deviceProperties);
+
+    // GPU timings are optional, frames simply go without them
+    timestampsSupported = validBits != 0;
+    if (!timestampsSupported) {
+        fprintf(stderr, "WARNING: graphics queue does not support "
+                        "timestamps, GPU timings disabled\n");
+        return 0;
+    }
+    timestampPeriodNs = deviceProperties.limits.timestampPeriod;
+    timestampMask = validBits >= 64 ? UINT64_MAX : (1ull << validBits) - 1;
+
+    VkQueryPoolCreateInfo queryPoolInfo = {
+        .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+        .queryType = VK_QUERY_TYPE_TIMESTAMP,
+        .queryCount = TIMESTAMP_COUNT,
+    };
+
+    for (size_t i = 0; i < framesInFlight; ++i) {
+        if (vkCreateQueryPool(device, &queryPoolInfo, NULL,
+                              &timestampQueryPools[i]) != VK_SUCCESS) {
+            fprintf(stderr, "ERROR: failed to create query pool\n");
+            return -1;
+        }
+        timestampsWritten[i] = false;
+    }
+
+    return 0;
+}
+
+// Must only be called once the frame slot was waited on, so the results
+// are already available and the query never stalls.
+void readGpuTimings(uint32_t frame) {
+    frameTimings.gpuValid = false;
+    if (!timestampsSupported || !timestampsWritten[frame]) {
+        return;
+    }
+
+    // each set of results is only reported once
+    timestampsWritten[frame] = false;
+
+    uint64_t timestamps[TIMESTAMP_COUNT];
+    if (vkGetQueryPoolResults(device, timestampQueryPools[frame], 0,
+                              TIMESTAMP_COUNT, sizeof(timestamps), timestamps,
+                              sizeof(timestamps[0]),
+                              VK_QUERY_RESULT_64_BIT) != VK_SUCCESS) {
+        return;
+    }
+
+    uint64_t frameTicks = (timestamps[TIMESTAMP_FRAME_END] -
+                           timestamps[TIMESTAMP_FRAME_BEGIN]) &
+                          timestampMask;
+    uint64_t drawTicks = (timestamps[TIMESTAMP_DRAW_END] -
+                          timestamps[TIMESTAMP_DRAW_BEGIN]) &
+                         timestampMask;
+    frameTimings.gpuValid = true;
+    frameTimings.gpuFrameMs = (double)frameTicks * timestampPeriodNs / 1e6;
+    frameTimings.gpuDrawMs = (double)drawTicks * timestampPeriodNs / 1e6;
+}
+
 int mainloop() {
-    while (!glfwWindowShouldClose(window)) {
-        glfwPollEvents();
-        drawFrame();
+    // warm-up frames run before the measured ones and are not recorded
+    uint64_t warmup = bench ? benchWarmup : 0;
+    uint64_t frameStart = nowNs();
+    uint64_t frame = 0;
+    while (frameLimit == 0 || frame < warmup + frameLimit) {
+        frameTimings = (FrameTimings){0};
+
+        // waiting first means the events polled below are the freshest
+        // input that can still make it into this frame
+        if (pacing == PACING_LOW_LATENCY) {
+            waitForFrame();
+        }
+
+        if (!headless) {
+            if (glfwWindowShouldClose(window)) {
+                break;
+            }
+            glfwPollEvents();
+        }
+        inputSampleNs = nowNs();
+
+        bool presented;
+        if (drawFrame(&presented) != 0) {
+            break;
+        }
+
+        // frame time is measured start to start so it includes pacing, an
+        // iteration that only recreated the swapchain is not a frame
+        uint64_t frameEnd = nowNs();
+        if (presented) {
+            if (bench && frame >= warmup) {
+                recordBenchSample((double)(frameEnd - frameStart) / 1e6);
+            }
+            ++frame;
+        }
+        frameStart = frameEnd;
     }
 
     vkDeviceWaitIdle(device);
@@ -1343,102 +5598,443 @@ int mainloop() {
     return 0;
 }
 
-int drawFrame() {
-    vkWaitForFences(device, 1, &inFlightFences[currentFrame], VK_TRUE,
-                    UINT64_MAX);
+// Blocks until the current frame slot's previous submission has finished.
+void waitForFrame() {
+    uint64_t waitStart = nowNs();
+    waitTimeline(&graphicsTimeline, frameTimelineValues[currentFrame]);
+    frameTimings.fenceWaitMs = elapsedMs(waitStart);
+    readGpuTimings(currentFrame);
+    frameWaited = true;
+}
 
-    uint32_t imageIndex;
+// presented is only set for a frame that was submitted and presented, or
+// submitted when headless, without recreating the swapchain on the way.
+int drawFrame(bool* presented) {
+    *presented = false;
+    if (!frameWaited) {
+        waitForFrame();
+    }
+    frameWaited = false;
 
-    VkResult result = vkAcquireNextImageKHR(
-        device, swapChain, UINT64_MAX, imageAvailableSemaphores[currentFrame],
-        VK_NULL_HANDLE, &imageIndex);
-    if (result == VK_ERROR_OUT_OF_DATE_KHR) {
-        recreateSwapChain();
-        return 0;
-    } else if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR) {
-        fprintf(stderr, "ERROR: Failed to acquire swapchain image\n");
+    collectDeletions();
+    if (hotReload) {
+        swapReloadedPipeline();
+    }
+    if (viewModeRequested) {
+        cycleViewMode();
+    }
+    if (!staticCommands && updateFrameData() != 0) {
         return -1;
     }
-    vkResetFences(device, 1, &inFlightFences[currentFrame]);
 
-    vkResetCommandBuffer(commandBuffers[currentFrame], 0);
+    uint32_t imageIndex;
+
+    if (headless) {
+        // every frame in flight owns an offscreen target, so the timeline wait
+        // above already guarantees the image is no longer in use
+        imageIndex = currentFrame;
+    } else {
+        uint64_t acquireStart = nowNs();
+        VkResult result = vkAcquireNextImageKHR(
+            device, swapChain, UINT64_MAX,
+            imageAvailableSemaphores[currentFrame], VK_NULL_HANDLE,
+            &imageIndex);
+        frameTimings.acquireMs = elapsedMs(acquireStart);
+        if (result == VK_ERROR_OUT_OF_DATE_KHR) {
+            recreateSwapChain();
+            return 0;
+        } else if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR) {
+            fprintf(stderr, "ERROR: Failed to acquire swapchain image\n");
+            return -1;
+        }
+    }
+    VkCommandBuffer submitCommandBuffers[3];
+    uint32_t submitCommandBufferCount = 0;
+
+    if (staticCommands) {
+        // a cached command buffer may not be resubmitted while pending, and
+        // the swapchain can hand out an image another frame still renders to
+        if (waitTimeline(&graphicsTimeline, imageTimelineValues[imageIndex]) !=
+            0) {
+            return -1;
+        }
+
+        if (staticCommandsDirty[imageIndex] &&
+            recordStaticCommandBuffer(imageIndex) != 0) {
+            return -1;
+        }
+
+        if (timestampsSupported) {
+            submitCommandBuffers[submitCommandBufferCount++] =
+                timestampBeginCommandBuffers[currentFrame];
+        }
+        submitCommandBuffers[submitCommandBufferCount++] =
+            staticCommandBuffers[imageIndex];
+        if (timestampsSupported) {
+            submitCommandBuffers[submitCommandBufferCount++] =
+                timestampEndCommandBuffers[currentFrame];
+        }
+    } else {
+        vkResetCommandBuffer(commandBuffers[currentFrame], 0);
 
-    recordCommandBuffer(commandBuffers[currentFrame], imageIndex);
+        VkQueryPool timestampPool = timestampsSupported
+                                        ? timestampQueryPools[currentFrame]
+                                        : VK_NULL_HANDLE;
+        if (recordCommandBuffer(commandBuffers[currentFrame], imageIndex,
+                                timestampPool) != 0) {
+            return -1;
+        }
+        submitCommandBuffers[submitCommandBufferCount++] =
+            commandBuffers[currentFrame];
+    }
+    timestampsWritten[currentFrame] = timestampsSupported;
 
+    // the binary semaphores are only there for the swapchain, which cannot
+    // use timelines; their entries in the value arrays are ignored
+    uint64_t frameValue = graphicsTimeline.lastSubmitted + 1;
     VkSemaphore waitSemaphores[] = {imageAvailableSemaphores[currentFrame]};
-    VkSemaphore signalSemaphores[] = {renderFinishedSemaphores[currentFrame]};
+    VkSemaphore signalSemaphores[] = {graphicsTimeline.semaphore,
+                                      renderFinishedSemaphores[currentFrame]};
+    uint64_t signalValues[] = {frameValue, 0};
     VkPipelineStageFlags waitStages[] = {
         VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
+    VkTimelineSemaphoreSubmitInfo timelineInfo = {
+        .sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
+        .signalSemaphoreValueCount = headless ? 1 : 2,
+        .pSignalSemaphoreValues = signalValues,
+    };
     VkSubmitInfo submitInfo = {
         .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-        .waitSemaphoreCount = 1,
+        .pNext = &timelineInfo,
+        .waitSemaphoreCount = headless ? 0 : 1,
         .pWaitSemaphores = waitSemaphores,
         .pWaitDstStageMask = waitStages,
-        .commandBufferCount = 1,
-        .pCommandBuffers = &commandBuffers[currentFrame],
-        .signalSemaphoreCount = 1,
+        .commandBufferCount = submitCommandBufferCount,
+        .pCommandBuffers = submitCommandBuffers,
+        .signalSemaphoreCount = headless ? 1 : 2,
         .pSignalSemaphores = signalSemaphores,
     };
 
-    if (vkQueueSubmit(graphicsQueue, 1, &submitInfo,
-                      inFlightFences[currentFrame]) != VK_SUCCESS) {
+    if (vkQueueSubmit(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE) !=
+        VK_SUCCESS) {
         fprintf(stderr, "ERROR: failed to submit draw command buffer\n");
         return -1;
     }
+    graphicsTimeline.lastSubmitted = frameValue;
+    frameTimelineValues[currentFrame] = frameValue;
+    if (staticCommands) {
+        imageTimelineValues[imageIndex] = frameValue;
+    }
+
+    if (headless) {
+        frameTimings.inputLatencyMs = elapsedMs(inputSampleNs);
+        currentFrame = (currentFrame + 1) % framesInFlight;
+        *presented = true;
+        return 0;
+    }
 
     VkSwapchainKHR swapchains[] = {swapChain};
     VkPresentInfoKHR presentInfo = {
         .sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
         .waitSemaphoreCount = 1,
-        .pWaitSemaphores = signalSemaphores,
+        .pWaitSemaphores = &renderFinishedSemaphores[currentFrame],
         .swapchainCount = 1,
         .pSwapchains = swapchains,
         .pImageIndices = &imageIndex,
         .pResults = NULL,
     };
 
-    result = vkQueuePresentKHR(presentQueue, &presentInfo);
-    if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR ||
-        framebufferResized) {
+    uint64_t presentStart = nowNs();
+    VkResult result = vkQueuePresentKHR(presentQueue, &presentInfo);
+    frameTimings.presentMs = elapsedMs(presentStart);
+    frameTimings.inputLatencyMs = elapsedMs(inputSampleNs);
+    if (result == VK_SUCCESS || result == VK_SUBOPTIMAL_KHR) {
+        countPresent();
+        *presented = true;
+    }
+    // An out of date swapchain can no longer be presented to. Suboptimal
+    // ones still work, so they wait until resize events have settled and a
+    // window drag ends in a single recreation.
+    if (result == VK_ERROR_OUT_OF_DATE_KHR) {
         framebufferResized = false;
         recreateSwapChain();
-    } else if (result != VK_SUCCESS) {
+    } else if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR) {
         fprintf(stderr, "ERROR: failed to present swapchain image\n");
         return -1;
+    } else if (result == VK_SUBOPTIMAL_KHR || framebufferResized) {
+        if (nowNs() - lastResizeNs >= RESIZE_DEBOUNCE_NS) {
+            framebufferResized = false;
+            recreateSwapChain();
+            // mostly recreation time, not a frame to measure
+            *presented = false;
+        }
     }
 
-    currentFrame = (currentFrame + 1) % MAX_FRAMES_IN_FLIGHT;
+    currentFrame = (currentFrame + 1) % framesInFlight;
 
     return 0;
 }
 
 void cleanup() {
+    if (hotReload) {
+        stopShaderReloader();
+    }
     cleanupSwapChain();
+    // the device is idle, everything still queued can go
+    destroyRetiredSwapChains();
+    flushDeletions();
+
+    destroyUploadManager();
+    destroyUniformRing();
+
+    if (cullDraws) {
+        vkDestroyPipeline(device, cullPipeline, NULL);
+        vkDestroyPipelineLayout(device, cullPipelineLayout, NULL);
+        vkDestroyDescriptorPool(device, cullDescriptorPool, NULL);
+        vkDestroyDescriptorSetLayout(device, cullSetLayout, NULL);
+        destroyBuffer(visibleBuffer, &visibleBufferMemory);
+        destroyBuffer(boundsBuffer, &boundsBufferMemory);
+    }
+    if (indirectDraws) {
+        destroyBuffer(indirectBuffer, &indirectBufferMemory);
+    }
+    free(drawCommands);
+    free(instanceData);
+    destroyBuffer(instanceBuffer, &instanceBufferMemory);
+    destroyBuffer(indexBuffer, &indexBufferMemory);
+    destroyBuffer(vertexBuffer, &vertexBufferMemory);
 
-    vkDestroyBuffer(device, indexBuffer, NULL);
-    vkFreeMemory(device, indexBufferMemory, NULL);
-
-    vkDestroyBuffer(device, vertexBuffer, NULL);
-    vkFreeMemory(device, vertexBufferMemory, NULL);
-
-    vkDestroyPipeline(device, graphicsPipeline, NULL);
+    destroyPipelineRegistry();
     vkDestroyPipelineLayout(device, pipelineLayout, NULL);
+    vkDestroyDescriptorSetLayout(device, frameSetLayout, NULL);
+    // a failed save only costs the next startup a recompile
+    savePipelineCache();
+    vkDestroyPipelineCache(device, pipelineCache, NULL);
     vkDestroyRenderPass(device, renderPass, NULL);
 
-    for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
+    for (size_t i = 0; i < framesInFlight; ++i) {
         vkDestroySemaphore(device, imageAvailableSemaphores[i], NULL);
         vkDestroySemaphore(device, renderFinishedSemaphores[i], NULL);
-        vkDestroyFence(device, inFlightFences[i], NULL);
+        if (timestampsSupported) {
+            vkDestroyQueryPool(device, timestampQueryPools[i], NULL);
+        }
+    }
+
+    vkDestroySemaphore(device, graphicsTimeline.semaphore, NULL);
+    if (transferQueueFamily != graphicsQueueFamily) {
+        vkDestroySemaphore(device, transferTimeline.semaphore, NULL);
     }
 
+    destroyRecordWorkers();
     vkDestroyCommandPool(device, commandPool, NULL);
 
+#ifndef NDEBUG
+    AllocatorStats stats = getAllocatorStats();
+    if (stats.allocationCount != 0) {
+        fprintf(stderr, "WARNING: %u device memory allocations leaked\n",
+                stats.allocationCount);
+    }
+#endif
+    destroyAllocator();
+
     vkDestroyDevice(device, NULL);
-    vkDestroySurfaceKHR(instance, surface, NULL);
+    if (!headless) {
+        vkDestroySurfaceKHR(instance, surface, NULL);
+    }
     vkDestroyInstance(instance, NULL);
 
-    glfwDestroyWindow(window);
-    glfwTerminate();
+    if (!headless) {
+        glfwDestroyWindow(window);
+        glfwTerminate();
+    }
+}
+
+int allocBenchSamples(uint64_t frameCount) {
+    benchSamples = (BenchSamples){
+        .frameCount = 0,
+        .frameMs = calloc(frameCount, sizeof(double)),
+        .fenceWaitMs = calloc(frameCount, sizeof(double)),
+        .acquireMs = calloc(frameCount, sizeof(double)),
+        .presentMs = calloc(frameCount, sizeof(double)),
+        .inputLatencyMs = calloc(frameCount, sizeof(double)),
+        .gpuFrameCount = 0,
+        .gpuFrameMs = calloc(frameCount, sizeof(double)),
+        .gpuDrawMs = calloc(frameCount, sizeof(double)),
+    };
+    if (benchSamples.frameMs == NULL || benchSamples.fenceWaitMs == NULL ||
+        benchSamples.acquireMs == NULL || benchSamples.presentMs == NULL ||
+        benchSamples.inputLatencyMs == NULL ||
+        benchSamples.gpuFrameMs == NULL || benchSamples.gpuDrawMs == NULL) {
+        fprintf(stderr, "ERROR: failed to allocate benchmark samples\n");
+        freeBenchSamples();
+        return -1;
+    }
+    return 0;
+}
+
+void recordBenchSample(double frameMs) {
+    uint64_t i = benchSamples.frameCount++;
+    benchSamples.frameMs[i] = frameMs;
+    benchSamples.fenceWaitMs[i] = frameTimings.fenceWaitMs;
+    benchSamples.acquireMs[i] = frameTimings.acquireMs;
+    benchSamples.presentMs[i] = frameTimings.presentMs;
+    benchSamples.inputLatencyMs[i] = frameTimings.inputLatencyMs;
+
+    if (frameTimings.gpuValid) {
+        uint64_t j = benchSamples.gpuFrameCount++;
+        benchSamples.gpuFrameMs[j] = frameTimings.gpuFrameMs;
+        benchSamples.gpuDrawMs[j] = frameTimings.gpuDrawMs;
+    }
+}
+
+static void writeSummary(FILE* out, const char* name, Summary summary,
+                         bool last) {
+    if (benchFormat == BENCH_FORMAT_CSV) {
+        fprintf(out,
+                "%s,min,%.6f\n%s,mean,%.6f\n%s,p50,%.6f\n%s,p95,%.6f\n"
+                "%s,p99,%.6f\n%s,max,%.6f\n%s,total,%.6f\n",
+                name, summary.min, name, summary.mean, name, summary.p50, name,
+                summary.p95, name, summary.p99, name, summary.max, name,
+                summary.total);
+    } else {
+        fprintf(out,
+                "  \"%s\": {\"min\": %.6f, \"mean\": %.6f, \"p50\": %.6f, "
+                "\"p95\": %.6f, \"p99\": %.6f, \"max\": %.6f, "
+                "\"total\": %.6f}%s\n",
+                name, summary.min, summary.mean, summary.p50, summary.p95,
+                summary.p99, summary.max, summary.total, last ? "" : ",");
+    }
+}
+
+static void writeValue(FILE* out, const char* name, double value, bool last) {
+    if (benchFormat == BENCH_FORMAT_CSV) {
+        fprintf(out, "%s,value,%.6f\n", name, value);
+    } else {
+        fprintf(out, "  \"%s\": %.6f%s\n", name, value, last ? "" : ",");
+    }
+}
+
+static void writeString(FILE* out, const char* name, const char* value,
+                        bool last) {
+    if (benchFormat == BENCH_FORMAT_CSV) {
+        fprintf(out, "%s,value,%s\n", name, value);
+    } else {
+        fprintf(out, "  \"%s\": \"%s\"%s\n", name, value, last ? "" : ",");
+    }
+}
+
+// Summaries sort the sample arrays in place, so this is called once at exit.
+void writeBenchReport(FILE* out) {
+    size_t n = benchSamples.frameCount;
+    if (n == 0) {
+        fprintf(stderr, "WARNING: no frames were measured\n");
+        return;
+    }
+
+    Summary frame = summarize(benchSamples.frameMs, n);
+    Summary fenceWait = summarize(benchSamples.fenceWaitMs, n);
+    Summary acquire = summarize(benchSamples.acquireMs, n);
+    Summary present = summarize(benchSamples.presentMs, n);
+    Summary inputLatency = summarize(benchSamples.inputLatencyMs, n);
+    size_t gpuCount = benchSamples.gpuFrameCount;
+    Summary gpuFrame = summarize(benchSamples.gpuFrameMs, gpuCount);
+    Summary gpuDraw = summarize(benchSamples.gpuDrawMs, gpuCount);
+
+    if (benchFormat == BENCH_FORMAT_CSV) {
+        fprintf(out, "metric,stat,value\n");
+    } else {
+        fprintf(out, "{\n");
+    }
+    writeValue(out, "frames", (double)n, false);
+    writeValue(out, "warmup_frames", (double)benchWarmup, false);
+    writeValue(out, "headless", headless, false);
+    writeString(out, "pacing", pacingNames[pacing], false);
+    writeValue(out, "frames_in_flight", framesInFlight, false);
+    writeValue(out, "packed_vertices", packedVertices, false);
+    writeValue(out, "vertex_buffer_bytes", vertexBufferMemory.size, false);
+    writeValue(out, "index_buffer_bytes", indexBufferMemory.size, false);
+    writeValue(out, "indirect_draws", indirectDraws, false);
+    writeValue(out, "gpu_culling", cullDraws, false);
+    writeValue(out, "serial_init", serialInit, false);
+    writeString(out, "view", viewModeNames[viewMode], false);
+    writeValue(out, "animate", animate, false);
+    writeValue(out, "pipeline_variants_built", registry.builds, false);
+    writeValue(out, "startup_ms", (double)startupNs / 1e6, false);
+    char name[64];
+    for (size_t stage = 0; stage < STARTUP_STAGE_COUNT; ++stage) {
+        snprintf(name, sizeof(name), "startup_%s_ms",
+                 startupStageNames[stage]);
+        writeValue(out, name, startupStageMs[stage], false);
+    }
+    writeValue(out, "fps", 1000.0 * (double)n / frame.total, false);
+    writeSummary(out, "cpu_frame_ms", frame, false);
+    writeSummary(out, "wait_for_frame_ms", fenceWait, false);
+    writeSummary(out, "acquire_next_image_ms", acquire, false);
+    writeSummary(out, "input_latency_ms", inputLatency, false);
+    AllocatorStats memory = getAllocatorStats();
+    writeValue(out, "memory_blocks", memory.blockCount, false);
+    writeValue(out, "memory_allocations", memory.allocationCount, false);
+    writeValue(out, "memory_allocated_bytes", memory.allocatedBytes, false);
+    writeValue(out, "memory_used_bytes", memory.usedBytes, false);
+    writeValue(out, "memory_requested_bytes", memory.requestedBytes, false);
+    writeValue(out, "memory_fragmentation", memory.fragmentation, false);
+    writeSummary(out, "queue_present_ms", present, gpuCount == 0);
+    if (gpuCount > 0) {
+        // close to 1 means the GPU is the bottleneck, close to 0 the CPU
+        writeValue(out, "gpu_busy_ratio", gpuFrame.mean / frame.mean, false);
+        writeSummary(out, "gpu_frame_ms", gpuFrame, false);
+        writeSummary(out, "gpu_draw_ms", gpuDraw, true);
+    }
+    if (benchFormat == BENCH_FORMAT_JSON) {
+        fprintf(out, "}\n");
+    }
+}
+
+// samples holds runs values per column, see runStartupOnly(). The first run
+// is reported as cold, the rest are summarized as warm.
+void writeStartupReport(FILE* out, double* samples, uint64_t runs) {
+    const char* totals[] = {"startup", "teardown"};
+    size_t columns = STARTUP_STAGE_COUNT + 2;
+    char name[64];
+
+    if (benchFormat == BENCH_FORMAT_CSV) {
+        fprintf(out, "metric,stat,value\n");
+    } else {
+        fprintf(out, "{\n");
+    }
+    writeValue(out, "startup_runs", (double)runs, false);
+    writeValue(out, "headless", headless, false);
+    writeValue(out, "serial_init", serialInit, false);
+    for (size_t column = 0; column < columns; ++column) {
+        const char* stage = column < STARTUP_STAGE_COUNT
+                                ? startupStageNames[column]
+                                : totals[column - STARTUP_STAGE_COUNT];
+        snprintf(name, sizeof(name), "cold_%s_ms", stage);
+        writeValue(out, name, samples[column * runs],
+                   runs == 1 && column + 1 == columns);
+    }
+    for (size_t column = 0; runs > 1 && column < columns; ++column) {
+        const char* stage = column < STARTUP_STAGE_COUNT
+                                ? startupStageNames[column]
+                                : totals[column - STARTUP_STAGE_COUNT];
+        snprintf(name, sizeof(name), "warm_%s_ms", stage);
+        Summary warm = summarize(&samples[column * runs + 1], runs - 1);
+        writeSummary(out, name, warm, column + 1 == columns);
+    }
+    if (benchFormat == BENCH_FORMAT_JSON) {
+        fprintf(out, "}\n");
+    }
+}
+
+void freeBenchSamples() {
+    free(benchSamples.frameMs);
+    free(benchSamples.fenceWaitMs);
+    free(benchSamples.acquireMs);
+    free(benchSamples.presentMs);
+    free(benchSamples.inputLatencyMs);
+    free(benchSamples.gpuFrameMs);
+    free(benchSamples.gpuDrawMs);
+    benchSamples = (BenchSamples){0};
 }
 
 // Returns NULL on failure
@@ -1478,8 +6074,48 @@ static char* readFile(const char* fileName, size_t* fileSize) {
     return dict;
 }
 
+static inline uint64_t nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static inline double elapsedMs(uint64_t startNs) {
+    return (double)(nowNs() - startNs) / 1e6;
+}
+
+// Sorts samples in place. Percentiles take the sample at or below the rank,
+// without interpolating.
+Summary summarize(double* samples, size_t count) {
+    Summary summary = {0};
+    if (count == 0) {
+        return summary;
+    }
+
+    qsort(samples, count, sizeof(samples[0]), compare_double);
+    for (size_t i = 0; i < count; ++i) {
+        summary.total += samples[i];
+    }
+    summary.min = samples[0];
+    summary.max = samples[count - 1];
+    summary.mean = summary.total / (double)count;
+    summary.p50 = samples[(count - 1) * 50 / 100];
+    summary.p95 = samples[(count - 1) * 95 / 100];
+    summary.p99 = samples[(count - 1) * 99 / 100];
+
+    return summary;
+}
+
+int compare_double(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
 int compare_uint32_t(const void* a, const void* b) {
-    return (*(uint32_t*)a - *(uint32_t*)b);
+    uint32_t x = *(const uint32_t*)a;
+    uint32_t y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
 }
 
 uint32_t removeDup(uint32_t arr[], size_t n) {
@@ -1487,7 +6123,7 @@ uint32_t removeDup(uint32_t arr[], size_t n) {
         return 0;
 
     int j = 0;
-    for (size_t i = 1; i < n - 1; i++) {
+    for (size_t i = 1; i < n; i++) {
 
         // If a unique element is found, place
         // it at arr[j + 1]
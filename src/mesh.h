@@ -0,0 +1,32 @@
+#ifndef MESH_H
+#define MESH_H
+
+#include <stdint.h>
+
+// Binary mesh container, written by tools/meshconv and mapped directly by
+// the renderer. A MeshHeader is followed by the vertex and index blobs, each
+// starting at a multiple of MESH_BLOB_ALIGNMENT from the start of the file.
+// Every field is little endian.
+
+#define MESH_MAGIC 0x4853454du // "MESH"
+#define MESH_VERSION 1
+#define MESH_BLOB_ALIGNMENT 64
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t vertexStride; // sizeof(MeshVertex)
+    uint32_t indexSize;    // bytes per index
+    uint64_t vertexCount;
+    uint64_t indexCount; // three per triangle
+    uint64_t vertexOffset;
+    uint64_t indexOffset;
+} MeshHeader;
+
+// same layout as struct Vertex in main.c
+typedef struct {
+    float position[2];
+    float color[3];
+} MeshVertex;
+
+#endif
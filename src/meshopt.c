@@ -0,0 +1,265 @@
+#include "meshopt.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+// entries of the post-transform cache the triangle order is tuned for, small
+// enough to hold on any GPU
+#define VERTEX_CACHE_SIZE 16
+#define NO_VERTEX UINT32_MAX
+
+// FNV-1a over the raw vertex bytes
+static uint32_t hashVertex(const MeshVertex* vertex) {
+    const unsigned char* bytes = (const unsigned char*)vertex;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < sizeof(MeshVertex); ++i) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Compacts the vertex array to unique vertices and points the indices at
+// the kept copies.
+static int deduplicateVertices(MeshVertex* vertices, size_t* vertexCount,
+                               uint32_t* indices, size_t indexCount) {
+    size_t count = *vertexCount;
+    size_t tableSize = 1;
+    while (tableSize < count * 2) {
+        tableSize *= 2;
+    }
+
+    uint32_t* table = malloc(sizeof(uint32_t) * tableSize);
+    uint32_t* remap = malloc(sizeof(uint32_t) * count);
+    if (table == NULL || remap == NULL) {
+        free(table);
+        free(remap);
+        return -1;
+    }
+    memset(table, 0xff, sizeof(uint32_t) * tableSize);
+
+    // open addressing, unique vertices are moved down as they are found
+    uint32_t unique = 0;
+    for (size_t i = 0; i < count; ++i) {
+        size_t slot = hashVertex(&vertices[i]) & (tableSize - 1);
+        while (table[slot] != NO_VERTEX &&
+               memcmp(&vertices[table[slot]], &vertices[i],
+                      sizeof(MeshVertex)) != 0) {
+            slot = (slot + 1) & (tableSize - 1);
+        }
+        if (table[slot] == NO_VERTEX) {
+            table[slot] = unique;
+            vertices[unique++] = vertices[i];
+        }
+        remap[i] = table[slot];
+    }
+
+    for (size_t i = 0; i < indexCount; ++i) {
+        indices[i] = remap[indices[i]];
+    }
+    *vertexCount = unique;
+
+    free(table);
+    free(remap);
+    return 0;
+}
+
+typedef struct {
+    uint32_t* triangleOffsets; // first entry of each vertex in triangles
+    uint32_t* triangles;       // triangles using each vertex
+    uint32_t* liveTriangles;   // not yet emitted triangles per vertex
+} Adjacency;
+
+static int buildAdjacency(Adjacency* adjacency, const uint32_t* indices,
+                          size_t indexCount, size_t vertexCount) {
+    adjacency->triangleOffsets = calloc(vertexCount + 1, sizeof(uint32_t));
+    adjacency->triangles = malloc(sizeof(uint32_t) * indexCount);
+    adjacency->liveTriangles = calloc(vertexCount, sizeof(uint32_t));
+    if (adjacency->triangleOffsets == NULL || adjacency->triangles == NULL ||
+        adjacency->liveTriangles == NULL) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < indexCount; ++i) {
+        ++adjacency->liveTriangles[indices[i]];
+    }
+    for (size_t v = 0; v < vertexCount; ++v) {
+        adjacency->triangleOffsets[v + 1] =
+            adjacency->triangleOffsets[v] + adjacency->liveTriangles[v];
+    }
+    // fill each vertex's list back to front using the counts as cursors
+    uint32_t* fill = malloc(sizeof(uint32_t) * vertexCount);
+    if (fill == NULL) {
+        return -1;
+    }
+    memcpy(fill, adjacency->triangleOffsets + 1,
+           sizeof(uint32_t) * vertexCount);
+    for (size_t i = indexCount; i-- > 0;) {
+        adjacency->triangles[--fill[indices[i]]] = (uint32_t)(i / 3);
+    }
+    free(fill);
+    return 0;
+}
+
+static void freeAdjacency(Adjacency* adjacency) {
+    free(adjacency->triangleOffsets);
+    free(adjacency->triangles);
+    free(adjacency->liveTriangles);
+}
+
+// Tipsify from Sander, Nehab and Barczak, "Fast Triangle Reordering for
+// Vertex Locality and Reduced Overdraw". Triangles are emitted as fans
+// around one vertex at a time, and the next fan center is a vertex of the
+// last fan that is still expected to be in the cache. Runs in linear time.
+static int optimizeVertexCache(uint32_t* indices, size_t indexCount,
+                               size_t vertexCount) {
+    size_t triangleCount = indexCount / 3;
+    Adjacency adjacency = {0};
+    uint32_t* source = malloc(sizeof(uint32_t) * indexCount);
+    // time each vertex last entered the simulated cache
+    uint32_t* cacheTime = calloc(vertexCount, sizeof(uint32_t));
+    // vertices of emitted triangles, revisited when a fan dead ends
+    uint32_t* deadEnds = malloc(sizeof(uint32_t) * indexCount);
+    bool* emitted = calloc(triangleCount, sizeof(bool));
+    int result = -1;
+    if (source == NULL || cacheTime == NULL || deadEnds == NULL ||
+        emitted == NULL ||
+        buildAdjacency(&adjacency, indices, indexCount, vertexCount) != 0) {
+        goto cleanup;
+    }
+    memcpy(source, indices, sizeof(uint32_t) * indexCount);
+
+    size_t out = 0;
+    size_t deadEndCount = 0;
+    size_t cursor = 0; // every vertex below has no live triangles left
+    uint32_t time = VERTEX_CACHE_SIZE + 1;
+    uint32_t fan = 0;
+    while (cursor < vertexCount && adjacency.liveTriangles[cursor] == 0) {
+        ++cursor;
+    }
+    fan = (uint32_t)cursor;
+
+    while (fan != NO_VERTEX) {
+        size_t fanStart = out;
+        for (uint32_t i = adjacency.triangleOffsets[fan];
+             i < adjacency.triangleOffsets[fan + 1]; ++i) {
+            uint32_t triangle = adjacency.triangles[i];
+            if (emitted[triangle]) {
+                continue;
+            }
+            emitted[triangle] = true;
+            for (int corner = 0; corner < 3; ++corner) {
+                uint32_t v = source[triangle * 3 + corner];
+                indices[out++] = v;
+                deadEnds[deadEndCount++] = v;
+                --adjacency.liveTriangles[v];
+                if (time - cacheTime[v] > VERTEX_CACHE_SIZE) {
+                    cacheTime[v] = time++;
+                }
+            }
+        }
+
+        // prefer the oldest candidate that will still be cached after its
+        // remaining triangles are emitted
+        fan = NO_VERTEX;
+        int32_t best = -1;
+        for (size_t i = fanStart; i < out; ++i) {
+            uint32_t v = indices[i];
+            if (adjacency.liveTriangles[v] == 0) {
+                continue;
+            }
+            int32_t priority = 0;
+            if (time - cacheTime[v] + 2 * adjacency.liveTriangles[v] <=
+                VERTEX_CACHE_SIZE) {
+                priority = (int32_t)(time - cacheTime[v]);
+            }
+            if (priority > best) {
+                best = priority;
+                fan = v;
+            }
+        }
+
+        while (fan == NO_VERTEX && deadEndCount > 0) {
+            uint32_t v = deadEnds[--deadEndCount];
+            if (adjacency.liveTriangles[v] > 0) {
+                fan = v;
+            }
+        }
+        while (fan == NO_VERTEX && cursor < vertexCount) {
+            if (adjacency.liveTriangles[cursor] > 0) {
+                fan = (uint32_t)cursor;
+            }
+            ++cursor;
+        }
+    }
+    result = 0;
+
+cleanup:
+    freeAdjacency(&adjacency);
+    free(source);
+    free(cacheTime);
+    free(deadEnds);
+    free(emitted);
+    return result;
+}
+
+// Renumbers vertices in first use order so vertex fetch walks memory
+// linearly, unreferenced vertices are dropped.
+static int optimizeVertexFetch(MeshVertex* vertices, size_t* vertexCount,
+                               uint32_t* indices, size_t indexCount) {
+    uint32_t* remap = malloc(sizeof(uint32_t) * *vertexCount);
+    MeshVertex* reordered = malloc(sizeof(MeshVertex) * *vertexCount);
+    if (remap == NULL || reordered == NULL) {
+        free(remap);
+        free(reordered);
+        return -1;
+    }
+    memset(remap, 0xff, sizeof(uint32_t) * *vertexCount);
+
+    uint32_t next = 0;
+    for (size_t i = 0; i < indexCount; ++i) {
+        uint32_t v = indices[i];
+        if (remap[v] == NO_VERTEX) {
+            reordered[next] = vertices[v];
+            remap[v] = next++;
+        }
+        indices[i] = remap[v];
+    }
+    memcpy(vertices, reordered, sizeof(MeshVertex) * next);
+    *vertexCount = next;
+
+    free(remap);
+    free(reordered);
+    return 0;
+}
+
+int optimizeMesh(MeshVertex* vertices, size_t* vertexCount, uint32_t* indices,
+                 size_t indexCount) {
+    if (deduplicateVertices(vertices, vertexCount, indices, indexCount) != 0 ||
+        optimizeVertexCache(indices, indexCount, *vertexCount) != 0 ||
+        optimizeVertexFetch(vertices, vertexCount, indices, indexCount) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+double meshCacheMissRatio(const uint32_t* indices, size_t indexCount,
+                          size_t vertexCount) {
+    uint32_t* cacheTime = calloc(vertexCount, sizeof(uint32_t));
+    if (cacheTime == NULL || indexCount < 3) {
+        free(cacheTime);
+        return 0.0;
+    }
+
+    uint32_t time = VERTEX_CACHE_SIZE + 1;
+    size_t misses = 0;
+    for (size_t i = 0; i < indexCount; ++i) {
+        uint32_t v = indices[i];
+        if (time - cacheTime[v] > VERTEX_CACHE_SIZE) {
+            cacheTime[v] = time++;
+            ++misses;
+        }
+    }
+
+    free(cacheTime);
+    return (double)misses / (double)(indexCount / 3);
+}
@@ -0,0 +1,25 @@
+#ifndef MESHOPT_H
+#define MESHOPT_H
+
+#include "mesh.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Mesh optimizations shared by tools/meshconv and the renderer's
+// --optimize-mesh load path. Indices are always 32 bit here, narrowing them
+// to 16 bit is up to the caller.
+
+// Merges bit-identical vertices, reorders the triangles for the
+// post-transform vertex cache and then renumbers the vertices in the order
+// the triangles first use them, dropping unreferenced ones. *vertexCount is
+// updated. Triangle order changes, so overlapping triangles may end up
+// stacked differently.
+int optimizeMesh(MeshVertex* vertices, size_t* vertexCount, uint32_t* indices,
+                 size_t indexCount);
+
+// Average vertex shader invocations per triangle for a FIFO post-transform
+// cache, between 0.5 and 3.0, lower is better.
+double meshCacheMissRatio(const uint32_t* indices, size_t indexCount,
+                          size_t vertexCount);
+
+#endif
@@ -1,4 +0,0 @@
-#!/usr/bin/env bash
-
-/usr/bin/glslc src/shaders/shader.vert -o src/shaders/vert.spv
-/usr/bin/glslc src/shaders/shader.frag -o src/shaders/frag.spv
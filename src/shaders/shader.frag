@@ -1,8 +1,21 @@
 #version 450
 
+// ViewMode in main.c, every mode is its own pipeline variant so the branch
+// is resolved when the pipeline is built
+layout(constant_id = 0) const int VIEW_MODE = 0;
+const int VIEW_WIREFRAME = 1;
+const int VIEW_OVERDRAW = 2;
+
 layout(location = 0) in vec3 fragColor;
 layout(location = 0) out vec4 outColor;
 
 void main() {
-    outColor = vec4(fragColor, 1.0);
+    if (VIEW_MODE == VIEW_WIREFRAME) {
+        outColor = vec4(1.0);
+    } else if (VIEW_MODE == VIEW_OVERDRAW) {
+        // blended additively, brighter means more layers
+        outColor = vec4(0.1, 0.05, 0.02, 1.0);
+    } else {
+        outColor = vec4(fragColor, 1.0);
+    }
 }
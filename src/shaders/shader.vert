@@ -3,9 +3,23 @@
 layout(location = 0) in vec2 inPosition;
 layout(location = 1) in vec3 inColor;
 
+layout(location = 2) in vec2 inOffset;
+layout(location = 3) in vec2 inScale;
+layout(location = 4) in vec3 inTint;
+
 layout(location = 0) out vec3 fragColor;
 
+layout(push_constant) uniform Transform {
+    mat4 mvp;
+};
+
+// FrameUniforms in main.c, at a dynamic offset into the uniform ring
+layout(std140, set = 0, binding = 0) uniform Frame {
+    vec4 tint;
+    float time; // seconds since startup
+} frame;
+
 void main() {
-    gl_Position = vec4(inPosition, 0.0, 1.0);
-    fragColor = inColor;
+    gl_Position = mvp * vec4(inPosition * inScale + inOffset, 0.0, 1.0);
+    fragColor = inColor * inTint * frame.tint.rgb;
 }
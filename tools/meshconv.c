@@ -0,0 +1,361 @@
+// Converts a Wavefront OBJ file into the binary mesh format of src/mesh.h.
+//
+// Only positions, optional per-vertex colors ("v x y z r g b") and faces are
+// read. Faces are triangulated as fans, the z coordinate is dropped since the
+// renderer is 2D. With -n the mesh is centered and scaled to fit the same
+// unit square as the built-in quad. With -g N no input is read, a grid of N by
+// N vertices is generated instead as a large benchmark mesh. With -O the mesh
+// is deduplicated and reordered for the vertex cache, see src/meshopt.h.
+//
+// Indices are written as 16 bit when every vertex fits, 32 bit otherwise.
+
+#define _GNU_SOURCE
+#include "mesh.h"
+#include "meshopt.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    MeshVertex* vertices;
+    size_t vertexCount;
+    size_t vertexCapacity;
+    uint32_t* indices;
+    size_t indexCount;
+    size_t indexCapacity;
+} Mesh;
+
+static int pushVertex(Mesh* mesh, MeshVertex vertex) {
+    if (mesh->vertexCount == mesh->vertexCapacity) {
+        size_t capacity =
+            mesh->vertexCapacity == 0 ? 1024 : mesh->vertexCapacity * 2;
+        MeshVertex* vertices =
+            realloc(mesh->vertices, sizeof(MeshVertex) * capacity);
+        if (vertices == NULL) {
+            return -1;
+        }
+        mesh->vertices = vertices;
+        mesh->vertexCapacity = capacity;
+    }
+    mesh->vertices[mesh->vertexCount++] = vertex;
+    return 0;
+}
+
+static int pushIndex(Mesh* mesh, uint32_t index) {
+    if (mesh->indexCount == mesh->indexCapacity) {
+        size_t capacity =
+            mesh->indexCapacity == 0 ? 4096 : mesh->indexCapacity * 2;
+        uint32_t* indices = realloc(mesh->indices, sizeof(uint32_t) * capacity);
+        if (indices == NULL) {
+            return -1;
+        }
+        mesh->indices = indices;
+        mesh->indexCapacity = capacity;
+    }
+    mesh->indices[mesh->indexCount++] = index;
+    return 0;
+}
+
+// "v x y [z [r g b]]"
+static int parseVertex(Mesh* mesh, const char* line) {
+    float values[6];
+    int count = 0;
+    char* end;
+    for (const char* p = line; count < 6; p = end) {
+        values[count] = strtof(p, &end);
+        if (end == p) {
+            break;
+        }
+        ++count;
+    }
+    if (count < 2) {
+        return -1;
+    }
+
+    MeshVertex vertex = {
+        .position = {values[0], values[1]},
+        .color = {1.0f, 1.0f, 1.0f},
+    };
+    if (count == 6) {
+        vertex.color[0] = values[3];
+        vertex.color[1] = values[4];
+        vertex.color[2] = values[5];
+    }
+    return pushVertex(mesh, vertex);
+}
+
+// "f a b c ...", each corner may be "v", "v/vt", "v//vn" or "v/vt/vn" and
+// negative indices count back from the latest vertex
+static int parseFace(Mesh* mesh, const char* line, size_t lineNumber) {
+    long corners[3];
+    int cornerCount = 0;
+    char* end;
+    for (const char* p = line;; p = end) {
+        long index = strtol(p, &end, 10);
+        if (end == p) {
+            break;
+        }
+        // skip texture coordinate and normal references
+        while (*end != '\0' && *end != ' ' && *end != '\t') {
+            ++end;
+        }
+
+        if (index < 0) {
+            index += (long)mesh->vertexCount;
+        } else {
+            index -= 1;
+        }
+        if (index < 0 || (size_t)index >= mesh->vertexCount) {
+            fprintf(stderr, "ERROR: line %zu: vertex index out of range\n",
+                    lineNumber);
+            return -1;
+        }
+
+        // fan triangulation around the first corner
+        if (cornerCount < 3) {
+            corners[cornerCount++] = index;
+        } else {
+            corners[1] = corners[2];
+            corners[2] = index;
+        }
+        if (cornerCount == 3) {
+            for (int i = 0; i < 3; ++i) {
+                if (pushIndex(mesh, (uint32_t)corners[i]) != 0) {
+                    return -1;
+                }
+            }
+        }
+    }
+
+    if (cornerCount < 3) {
+        fprintf(stderr, "ERROR: line %zu: face needs three vertices\n",
+                lineNumber);
+        return -1;
+    }
+    return 0;
+}
+
+static int readObj(Mesh* mesh, FILE* in) {
+    char* line = NULL;
+    size_t lineCapacity = 0;
+    size_t lineNumber = 0;
+    int result = 0;
+
+    while (result == 0 && getline(&line, &lineCapacity, in) != -1) {
+        ++lineNumber;
+        if (strncmp(line, "v ", 2) == 0) {
+            if (mesh->vertexCount == UINT32_MAX) {
+                fprintf(stderr, "ERROR: too many vertices\n");
+                result = -1;
+            } else if (parseVertex(mesh, line + 2) != 0) {
+                fprintf(stderr, "ERROR: line %zu: bad vertex\n", lineNumber);
+                result = -1;
+            }
+        } else if (strncmp(line, "f ", 2) == 0) {
+            result = parseFace(mesh, line + 2, lineNumber);
+        }
+    }
+
+    free(line);
+    return result;
+}
+
+// Centers the mesh on the origin and scales it into [-0.5, 0.5].
+static void normalize(Mesh* mesh) {
+    float min[2] = {mesh->vertices[0].position[0],
+                    mesh->vertices[0].position[1]};
+    float max[2] = {min[0], min[1]};
+    for (size_t i = 1; i < mesh->vertexCount; ++i) {
+        for (int axis = 0; axis < 2; ++axis) {
+            float value = mesh->vertices[i].position[axis];
+            min[axis] = value < min[axis] ? value : min[axis];
+            max[axis] = value > max[axis] ? value : max[axis];
+        }
+    }
+
+    float extent = max[0] - min[0] > max[1] - min[1] ? max[0] - min[0]
+                                                     : max[1] - min[1];
+    float scale = extent > 0.0f ? 1.0f / extent : 1.0f;
+    for (size_t i = 0; i < mesh->vertexCount; ++i) {
+        for (int axis = 0; axis < 2; ++axis) {
+            float center = 0.5f * (min[axis] + max[axis]);
+            mesh->vertices[i].position[axis] =
+                (mesh->vertices[i].position[axis] - center) * scale;
+        }
+    }
+}
+
+// N by N vertices over the unit square, colored by position
+static int makeGrid(Mesh* mesh, long n) {
+    for (long y = 0; y < n; ++y) {
+        for (long x = 0; x < n; ++x) {
+            float u = (float)x / (float)(n - 1);
+            float v = (float)y / (float)(n - 1);
+            MeshVertex vertex = {
+                .position = {u - 0.5f, v - 0.5f},
+                .color = {u, v, 1.0f - u},
+            };
+            if (pushVertex(mesh, vertex) != 0) {
+                return -1;
+            }
+        }
+    }
+
+    for (long y = 0; y + 1 < n; ++y) {
+        for (long x = 0; x + 1 < n; ++x) {
+            uint32_t corner = (uint32_t)(y * n + x);
+            uint32_t quad[6] = {corner,         corner + 1,
+                                corner + n + 1, corner + n + 1,
+                                corner + n,     corner};
+            for (int i = 0; i < 6; ++i) {
+                if (pushIndex(mesh, quad[i]) != 0) {
+                    return -1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+static uint64_t alignUp(uint64_t value) {
+    uint64_t mask = MESH_BLOB_ALIGNMENT - 1;
+    return (value + mask) & ~mask;
+}
+
+static bool writePadded(FILE* out, const void* data, size_t size,
+                        uint64_t paddedSize) {
+    static const char zeros[MESH_BLOB_ALIGNMENT];
+    return fwrite(data, 1, size, out) == size &&
+           fwrite(zeros, 1, paddedSize - size, out) == paddedSize - size;
+}
+
+// Narrows the indices in place when every vertex fits 16 bits.
+static int writeMesh(Mesh* mesh, FILE* out) {
+    bool shortIndices = mesh->vertexCount <= UINT16_MAX + 1;
+    if (shortIndices) {
+        uint16_t* narrow = (uint16_t*)mesh->indices;
+        for (size_t i = 0; i < mesh->indexCount; ++i) {
+            narrow[i] = (uint16_t)mesh->indices[i];
+        }
+    }
+
+    MeshHeader header = {
+        .magic = MESH_MAGIC,
+        .version = MESH_VERSION,
+        .vertexStride = sizeof(MeshVertex),
+        .indexSize = shortIndices ? sizeof(uint16_t) : sizeof(uint32_t),
+        .vertexCount = mesh->vertexCount,
+        .indexCount = mesh->indexCount,
+    };
+    uint64_t vertexBytes = sizeof(MeshVertex) * mesh->vertexCount;
+    uint64_t indexBytes = header.indexSize * mesh->indexCount;
+    header.vertexOffset = alignUp(sizeof(header));
+    header.indexOffset = header.vertexOffset + alignUp(vertexBytes);
+
+    if (!writePadded(out, &header, sizeof(header), header.vertexOffset) ||
+        !writePadded(out, mesh->vertices, vertexBytes, alignUp(vertexBytes)) ||
+        fwrite(mesh->indices, 1, indexBytes, out) != indexBytes) {
+        return -1;
+    }
+    return 0;
+}
+
+static void printUsage(const char* program) {
+    fprintf(stderr,
+            "usage: %s [-O] [-n] input.obj output.mesh\n"
+            "       %s [-O] -g N output.mesh\n"
+            "  -O    optimize vertex and triangle order\n"
+            "  -n    center and scale the mesh to the unit square\n"
+            "  -g N  generate a grid of N by N vertices, 2 <= N <= 4096\n",
+            program, program);
+}
+
+int main(int argc, char** argv) {
+    bool optimize = false;
+    bool normalizeMesh = false;
+    long gridSize = 0;
+    int arg = 1;
+    if (arg < argc && strcmp(argv[arg], "-O") == 0) {
+        optimize = true;
+        ++arg;
+    }
+    if (arg < argc && strcmp(argv[arg], "-n") == 0) {
+        normalizeMesh = true;
+        ++arg;
+    } else if (arg + 1 < argc && strcmp(argv[arg], "-g") == 0) {
+        char* end;
+        gridSize = strtol(argv[arg + 1], &end, 10);
+        if (*end != '\0' || gridSize < 2 || gridSize > 4096) {
+            printUsage(argv[0]);
+            return 1;
+        }
+        arg += 2;
+    }
+    if (argc - arg != (gridSize > 0 ? 1 : 2)) {
+        printUsage(argv[0]);
+        return 1;
+    }
+    const char* outputPath = argv[argc - 1];
+
+    Mesh mesh = {0};
+    int result;
+    if (gridSize > 0) {
+        result = makeGrid(&mesh, gridSize);
+        if (result != 0) {
+            fprintf(stderr, "ERROR: out of memory\n");
+        }
+    } else {
+        const char* inputPath = argv[arg];
+        FILE* in = fopen(inputPath, "r");
+        if (in == NULL) {
+            fprintf(stderr, "ERROR: couldn't open file %s\n", inputPath);
+            return 1;
+        }
+        result = readObj(&mesh, in);
+        fclose(in);
+
+        if (result == 0 && mesh.indexCount == 0) {
+            fprintf(stderr, "ERROR: %s has no faces\n", inputPath);
+            result = -1;
+        }
+    }
+
+    if (result == 0 && optimize) {
+        size_t vertexCount = mesh.vertexCount;
+        double before =
+            meshCacheMissRatio(mesh.indices, mesh.indexCount, vertexCount);
+        result = optimizeMesh(mesh.vertices, &mesh.vertexCount, mesh.indices,
+                              mesh.indexCount);
+        if (result != 0) {
+            fprintf(stderr, "ERROR: out of memory\n");
+        } else {
+            fprintf(stderr, "vertices: %zu -> %zu, ACMR: %.3f -> %.3f\n",
+                    vertexCount, mesh.vertexCount, before,
+                    meshCacheMissRatio(mesh.indices, mesh.indexCount,
+                                       mesh.vertexCount));
+        }
+    }
+
+    if (result == 0) {
+        if (normalizeMesh) {
+            normalize(&mesh);
+        }
+
+        FILE* out = fopen(outputPath, "wb");
+        if (out == NULL) {
+            fprintf(stderr, "ERROR: couldn't open file %s\n", outputPath);
+            result = -1;
+        } else {
+            result = writeMesh(&mesh, out);
+            if (fclose(out) != 0 || result != 0) {
+                fprintf(stderr, "ERROR: failed to write %s\n", outputPath);
+                result = -1;
+            }
+        }
+    }
+
+    free(mesh.vertices);
+    free(mesh.indices);
+    return result == 0 ? 0 : 1;
+}